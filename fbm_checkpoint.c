@@ -0,0 +1,225 @@
+/* fracbm-fpt-mc (2019)
+ *
+ * Authors: Benjamin Walter (Imperial College) , Kay Wiese (ENS Paris)
+ *
+ * Running aggregates of the ensemble, checkpoint/restart of long runs and result files of shards.
+ */
+
+
+#include "fbm_header.h"
+
+void initialise_statistics(fpt_statistics* stats)
+{
+	stats->samples = 0;
+	stats->passages = 0;
+	stats->sum_weight = 0.0;
+	stats->sum_weight_squared = 0.0;
+	stats->sum_passages = 0.0;
+	stats->sum_passages_squared = 0.0;
+	stats->sum_fpt = 0.0;
+	stats->sum_fpt_squared = 0.0;
+	stats->sum_zvar = 0.0;
+	stats->sum_zvar_squared = 0.0;
+}
+
+void update_statistics(fpt_statistics* stats, double first_passage_time, double zvar, double weight)
+{
+	stats->samples++;
+	stats->sum_weight += weight;
+	stats->sum_weight_squared += (weight*weight);
+	if(first_passage_time < 1.0) // FPT = 1.0 is the censored value, no passage on [0,1]
+	{
+		stats->passages++;
+		stats->sum_passages += weight;
+		stats->sum_passages_squared += (weight*weight);
+	}
+	stats->sum_fpt += (weight*first_passage_time);
+	stats->sum_fpt_squared += (weight*first_passage_time*first_passage_time);
+	stats->sum_zvar += (weight*zvar);
+	stats->sum_zvar_squared += (weight*zvar*zvar);
+}
+
+void print_statistics(fpt_statistics* stats)
+{
+	// All estimates are plain (not self-normalised) importance sampling averages, sum w*f / n
+	if(stats->samples == 0) return;
+	double n = ((double) stats->samples);
+	double probability = (stats->sum_passages / n);
+	double mean_fpt = (stats->sum_fpt / n);
+	double mean_zvar = (stats->sum_zvar / n);
+	printf("# Samples: %ld, passages before t=1: %ld\n", stats->samples, stats->passages);
+	printf("# P(FPT < 1): %.12g +- %.3g\n", probability, sqrt(MAX((stats->sum_passages_squared / n - probability*probability), 0.0) / n));
+	printf("# Mean censored FPT: %.12g, variance: %.12g\n", mean_fpt, (stats->sum_fpt_squared / n - mean_fpt*mean_fpt));
+	printf("# Mean z: %.12g, variance: %.12g\n", mean_zvar, (stats->sum_zvar_squared / n - mean_zvar*mean_zvar));
+	if( (stats->sum_weight != n) || (stats->sum_weight_squared != n))
+	{
+		printf("# Importance sampling: mean weight %.6g, effective sample size %.6g\n", (stats->sum_weight / n), ((stats->sum_weight * stats->sum_weight) / stats->sum_weight_squared));
+	}
+}
+
+int compatible_parameters(fbm_parameters* a, fbm_parameters* b)
+{
+	// Two runs sample the same ensemble if all model and resolution parameters, and the seed, coincide.
+	// Coarse-to-fine levels only move levels from the subgrid to the bisection, so the split that is actually sampled is compared.
+	return ( (a->hurst == b->hurst) && ( (a->g - a->coarse_levels) == (b->g - b->coarse_levels)) && ( (a->max_generation + a->coarse_levels) == (b->max_generation + b->coarse_levels)) && (a->epsilon == b->epsilon) && (a->lin_drift == b->lin_drift) && (a->frac_drift == b->frac_drift) && (a->passage_height == b->passage_height) && (a->seed == b->seed) && (a->tilt == b->tilt) && (a->single_precision == b->single_precision));
+}
+
+void write_statistics(FILE* f, fpt_statistics* stats)
+{
+	fprintf(f, "samples %ld\npassages %ld\nsum_weight %a\nsum_weight_squared %a\nsum_passages %a\nsum_passages_squared %a\nsum_fpt %a\nsum_fpt_squared %a\nsum_zvar %a\nsum_zvar_squared %a\n", stats->samples, stats->passages, stats->sum_weight, stats->sum_weight_squared, stats->sum_passages, stats->sum_passages_squared, stats->sum_fpt, stats->sum_fpt_squared, stats->sum_zvar, stats->sum_zvar_squared);
+}
+
+int read_statistics(FILE* f, fpt_statistics* stats)
+{
+	// Returns 1 if all fields were read
+	int fields = fscanf(f, "samples %ld\npassages %ld\nsum_weight %la\nsum_weight_squared %la\nsum_passages %la\nsum_passages_squared %la\nsum_fpt %la\nsum_fpt_squared %la\nsum_zvar %la\nsum_zvar_squared %la\n", &(stats->samples), &(stats->passages), &(stats->sum_weight), &(stats->sum_weight_squared), &(stats->sum_passages), &(stats->sum_passages_squared), &(stats->sum_fpt), &(stats->sum_fpt_squared), &(stats->sum_zvar), &(stats->sum_zvar_squared));
+	return (fields == 10);
+}
+
+void write_parameters(FILE* f, fbm_parameters* params)
+{
+	fprintf(f, "hurst %a\ng %i\nG %i\nepsilon %a\nlin_drift %a\nfrac_drift %a\nbarrier %a\nseed %i\ncoarse_levels %i\ntilt %a\nsingle_precision %i\n", params->hurst, params->g, params->max_generation, params->epsilon, params->lin_drift, params->frac_drift, params->passage_height, params->seed, params->coarse_levels, params->tilt, params->single_precision);
+}
+
+int read_parameters(FILE* f, fbm_parameters* params)
+{
+	// Returns 1 if all fields were read
+	int fields = fscanf(f, "hurst %la\ng %i\nG %i\nepsilon %la\nlin_drift %la\nfrac_drift %la\nbarrier %la\nseed %i\ncoarse_levels %i\ntilt %la\nsingle_precision %i\n", &(params->hurst), &(params->g), &(params->max_generation), &(params->epsilon), &(params->lin_drift), &(params->frac_drift), &(params->passage_height), &(params->seed), &(params->coarse_levels), &(params->tilt), &(params->single_precision));
+	return (fields == 11);
+}
+
+void write_drift_statistics(FILE* f, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, fpt_statistics* stats)
+{
+	int d;
+	fprintf(f, "drifts %i\n", number_of_drifts);
+	for(d = 0; d < number_of_drifts; d++)
+	{
+		fprintf(f, "drift %a %a\n", lin_drifts[d], frac_drifts[d]);
+		write_statistics(f, &(stats[d]));
+	}
+}
+
+int read_drift_statistics(FILE* f, int* number_of_drifts, double** lin_drifts, double** frac_drifts, fpt_statistics** stats)
+{
+	// Allocates the drift list and the statistics. Returns 1 if all fields were read.
+	int d;
+	if( (fscanf(f, "drifts %i\n", number_of_drifts) != 1) || ((*number_of_drifts) < 1)) return 0;
+	ALLOC(*lin_drifts, *number_of_drifts);
+	ALLOC(*frac_drifts, *number_of_drifts);
+	ALLOC(*stats, *number_of_drifts);
+	for(d = 0; d < (*number_of_drifts); d++)
+	{
+		if( (fscanf(f, "drift %la %la\n", &((*lin_drifts)[d]), &((*frac_drifts)[d])) != 2) || (!read_statistics(f, &((*stats)[d])))) return 0;
+	}
+	return 1;
+}
+
+FILE* open_replacement(const char* filename, char* tmpname)
+{
+	// Files are written under a temporary name and renamed into place by close_replacement, so an interrupted write leaves the previous version intact
+	if(snprintf(tmpname, CHECKPOINT_NAME_LENGTH, "%s.tmp", filename) >= CHECKPOINT_NAME_LENGTH){fprintf(stderr, "File name '%s' too long. Terminate.\n", filename); exit(1);}
+	FILE* f = fopen(tmpname, "wb");
+	if(f == NULL){fprintf(stderr, "Cannot write '%s'. Terminate.\n", tmpname); exit(2);}
+	return f;
+}
+
+void close_replacement(FILE* f, const char* filename, const char* tmpname)
+{
+	if( (fflush(f) != 0) || (fsync(fileno(f)) != 0) || (fclose(f) != 0)){fprintf(stderr, "Cannot write '%s'. Terminate.\n", tmpname); exit(2);}
+	if(rename(tmpname, filename) != 0){fprintf(stderr, "Cannot rename '%s' to '%s'. Terminate.\n", tmpname, filename); exit(2);}
+}
+
+void write_checkpoint(const char* filename, fbm_sampler* sampler, long completed, long output_offset, int sample_streams, long first_sample, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, fpt_statistics* stats)
+{
+	/* The checkpoint is a short text header (doubles in hex notation, so they are restored bit by bit) with the aggregates of every drift, followed by the binary GSL RNG state.
+	 * 'completed' is the index of the next sample, samples are counted from first_sample (> 0 for shards). */
+	char tmpname[CHECKPOINT_NAME_LENGTH];
+	FILE* f = open_replacement(filename, tmpname);
+	gsl_rng* rng = sampler->r;
+	fprintf(f, "%s %i\n", CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+	write_parameters(f, &(sampler->params));
+	fprintf(f, "completed %ld\noutput_offset %ld\nunresolved_midpoints %ld\n", completed, output_offset, sampler->QI->unresolved_midpoints);
+	fprintf(f, "sample_streams %i\nfirst_sample %ld\n", sample_streams, first_sample);
+	write_drift_statistics(f, number_of_drifts, lin_drifts, frac_drifts, stats);
+	fprintf(f, "rng %s %zu\n", gsl_rng_name(rng), gsl_rng_size(rng));
+	if(gsl_rng_fwrite(f, rng) != 0){fprintf(stderr, "Cannot write RNG state to '%s'. Terminate.\n", tmpname); exit(2);}
+	close_replacement(f, filename, tmpname);
+}
+
+void read_checkpoint(const char* filename, fbm_parameters* params, long* completed, long* output_offset, int* sample_streams, long* first_sample, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, fpt_statistics* stats, fbm_sampler* sampler)
+{
+	// Restores a checkpoint into params, the counters, stats and the sampler. The drifts of the checkpoint must be the ones given. sample_streams is 1 if the run drew every sample from its own streams (pipeline), 0 if from the RNG of the sampler.
+	gsl_rng* rng = sampler->r;
+	FILE* f = fopen(filename, "rb");
+	if(f == NULL){fprintf(stderr, "Cannot open checkpoint '%s'. Terminate.\n", filename); exit(1);}
+
+	char magic[64], rng_name[64];
+	int version, d, checkpoint_drifts;
+	double *checkpoint_lin_drifts, *checkpoint_frac_drifts;
+	fpt_statistics *checkpoint_stats;
+	size_t rng_size;
+	int fields = 0;
+	if( (fscanf(f, "%63s %i\n", magic, &version) != 2) || (strcmp(magic, CHECKPOINT_MAGIC) != 0) || (version != CHECKPOINT_VERSION)){fprintf(stderr, "Checkpoint '%s' is damaged or of an unknown format. Terminate.\n", filename); exit(1);}
+	fields += read_parameters(f, params);
+	fields += fscanf(f, "completed %ld\noutput_offset %ld\nunresolved_midpoints %ld\n", completed, output_offset, &(sampler->QI->unresolved_midpoints));
+	fields += fscanf(f, "sample_streams %i\nfirst_sample %ld\n", sample_streams, first_sample);
+	fields += read_drift_statistics(f, &checkpoint_drifts, &checkpoint_lin_drifts, &checkpoint_frac_drifts, &checkpoint_stats);
+	if(fields != 7){fprintf(stderr, "Checkpoint '%s' is damaged. Terminate.\n", filename); exit(1);}
+	if(checkpoint_drifts != number_of_drifts){fprintf(stderr, "Checkpoint '%s' was written for %i drifts, not %i. Terminate.\n", filename, checkpoint_drifts, number_of_drifts); exit(1);}
+	for(d = 0; d < number_of_drifts; d++)
+	{
+		if( (checkpoint_lin_drifts[d] != lin_drifts[d]) || (checkpoint_frac_drifts[d] != frac_drifts[d])){fprintf(stderr, "Checkpoint '%s' was written for different drifts. Terminate.\n", filename); exit(1);}
+		stats[d] = checkpoint_stats[d];
+	}
+	free(checkpoint_lin_drifts);
+	free(checkpoint_frac_drifts);
+	free(checkpoint_stats);
+	if( (fscanf(f, "rng %63s %zu", rng_name, &rng_size) != 2) || (fgetc(f) != '\n')){fprintf(stderr, "Checkpoint '%s' is damaged. Terminate.\n", filename); exit(1);}
+	if( (strcmp(rng_name, gsl_rng_name(rng)) != 0) || (rng_size != gsl_rng_size(rng))){fprintf(stderr, "Checkpoint '%s' was written with RNG '%s', this run uses '%s'. Terminate.\n", filename, rng_name, gsl_rng_name(rng)); exit(1);}
+	if(gsl_rng_fread(f, rng) != 0){fprintf(stderr, "Cannot read RNG state from '%s'. Terminate.\n", filename); exit(1);}
+	fclose(f);
+}
+
+void write_result(const char* filename, fbm_parameters* params, long ensemble_size, int shard, int shards, long first_sample, long last_sample, long unresolved_midpoints, int sample_streams, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, fpt_statistics* stats)
+{
+	/* Result of a run or shard: parameters, the size of the ensemble (-I) and the shard i/n, the samples [first_sample, last_sample) it covers and the aggregates per drift, in the notation of the checkpoints. Self-contained, fbm-merge combines such files.
+	 * A run without --shard is shard 0/1, a merge of shards that does not cover the whole ensemble is shard -1/0. */
+	char tmpname[CHECKPOINT_NAME_LENGTH];
+	FILE* f = open_replacement(filename, tmpname);
+	fprintf(f, "%s %i\n", RESULT_MAGIC, CHECKPOINT_VERSION);
+	write_parameters(f, params);
+	fprintf(f, "sample_streams %i\nensemble_size %ld\nshard %i %i\nfirst_sample %ld\nlast_sample %ld\nunresolved_midpoints %ld\n", sample_streams, ensemble_size, shard, shards, first_sample, last_sample, unresolved_midpoints);
+	write_drift_statistics(f, number_of_drifts, lin_drifts, frac_drifts, stats);
+	close_replacement(f, filename, tmpname);
+}
+
+void read_result(const char* filename, fbm_parameters* params, long* ensemble_size, int* shard, int* shards, long* first_sample, long* last_sample, long* unresolved_midpoints, int* sample_streams, int* number_of_drifts, double** lin_drifts, double** frac_drifts, fpt_statistics** stats)
+{
+	// Allocates the drift list and the statistics
+	FILE* f = fopen(filename, "r");
+	if(f == NULL){fprintf(stderr, "Cannot open result '%s'. Terminate.\n", filename); exit(1);}
+
+	char magic[64];
+	int version;
+	int fields = 0;
+	if( (fscanf(f, "%63s %i\n", magic, &version) != 2) || (strcmp(magic, RESULT_MAGIC) != 0) || (version != CHECKPOINT_VERSION)){fprintf(stderr, "Result '%s' is damaged or of an unknown format. Terminate.\n", filename); exit(1);}
+	fields += read_parameters(f, params);
+	fields += fscanf(f, "sample_streams %i\nensemble_size %ld\nshard %i %i\nfirst_sample %ld\nlast_sample %ld\nunresolved_midpoints %ld\n", sample_streams, ensemble_size, shard, shards, first_sample, last_sample, unresolved_midpoints);
+	fields += read_drift_statistics(f, number_of_drifts, lin_drifts, frac_drifts, stats);
+	if(fields != 9){fprintf(stderr, "Result '%s' is damaged. Terminate.\n", filename); exit(1);}
+	fclose(f);
+}
+
+void add_statistics(fpt_statistics* total, fpt_statistics* part)
+{
+	total->samples += part->samples;
+	total->passages += part->passages;
+	total->sum_weight += part->sum_weight;
+	total->sum_weight_squared += part->sum_weight_squared;
+	total->sum_passages += part->sum_passages;
+	total->sum_passages_squared += part->sum_passages_squared;
+	total->sum_fpt += part->sum_fpt;
+	total->sum_fpt_squared += part->sum_fpt_squared;
+	total->sum_zvar += part->sum_zvar;
+	total->sum_zvar_squared += part->sum_zvar_squared;
+}
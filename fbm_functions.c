@@ -8,50 +8,131 @@
 #include "fbm_header.h"
 
 // Globals recall
-int max_generation;
-double *gamma_N_vec;
-double *g_vec;
-triag_matrix *QI;
-double lin_drift, frac_drift;
-double *xfracbm;
+__thread int max_generation;
+__thread double *gamma_N_vec;
+__thread double *g_vec;
+__thread triag_matrix *QI;
+__thread double lin_drift, frac_drift;
+__thread double *xfracbm;
+__thread gsl_rng *r;
+__thread jmp_buf *error_handler = NULL;
+__thread char error_message[ERROR_MESSAGE_LENGTH] = "";
+
+void set_error_message(const char* format, ...)
+{
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(error_message, ERROR_MESSAGE_LENGTH, format, arguments);
+	va_end(arguments);
+}
 
-void initialise( fftw_complex** correlation,  fftw_complex** circulant_eigenvalues,  fftw_complex** rndW,  fftw_complex** fracGN,  double** correlation_exponents, complex_z** randomComplexGaussian, long N, gsl_rng** r,const gsl_rng_type** T, int seed)
+void fbm_error(int status, const char* format, ...)
 {
-	// These are the objects that are N long (the increments)
+	// Inside a library call, return to its entry point, which reports the error to the caller. Otherwise (command line tools) terminate.
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(error_message, ERROR_MESSAGE_LENGTH, format, arguments);
+	va_end(arguments);
+	if(error_handler != NULL){longjmp(*error_handler, status);}
+	printf("%s Terminate. \n", error_message);
+	exit(status);
+}
+
+const char* fbm_error_message(void)
+{
+	return error_message;
+}
+
+void initialise( fftw_complex** correlation,  fftw_complex** circulant_eigenvalues,  fftw_complex** rndW,  fftw_complex** fracGN,  double** correlation_exponents, complex_z** randomComplexGaussian, long N, gsl_rng** r,const gsl_rng_type** T, int* seed, int single_precision)
+{
+	// These are the objects that are N long (the increments). A single precision subgrid is drawn into buffers of its own, the double ones are then left NULL.
 	FFT_ALLOC(*correlation, 2*N);
 	FFT_ALLOC(*circulant_eigenvalues, 2*N);
-	FFT_ALLOC(*rndW, 2*N);
-	FFT_ALLOC(*fracGN, 2*N);
+	*rndW = NULL;
+	*fracGN = NULL;
+	*randomComplexGaussian = NULL;
+	if(!single_precision)
+	{
+		FFT_ALLOC(*rndW, 2*N);
+		FFT_ALLOC(*fracGN, 2*N);
+	}
 
 	ALLOC(*correlation_exponents, 2*N);
 	set_to_zero(*correlation_exponents, 2*N);
-	ALLOC(*randomComplexGaussian, N);
+	if(!single_precision){ALLOC(*randomComplexGaussian, N);}
 	
 	/* Initialises GSL Random Generator */
         gsl_rng_env_setup();
         *T = gsl_rng_default;
         *r = gsl_rng_alloc (*T);
-        if(seed==-1) seed = ((int) (((int) clock() ) % 100000));
-        gsl_rng_set(*r, seed);
-        printf("# RNG Seed %i\n",seed);
+        if(*seed==-1) *seed = ((int) (((int) clock() ) % 100000));
+        gsl_rng_set(*r, *seed);
 }
 
-void initialise_trajectory(  double ** fracbm, long N)
+void initialise_trajectory(  double ** fracbm, double ** xfracbm, long N)
 {
 	// N increments give N+1 points
-	ALLOC( xfracbm, N+1); // X_t
+	ALLOC( *xfracbm, N+1); // X_t
 	ALLOC( *fracbm, N+1); // X_t + drift terms
 }
 
-void initialise_inverse_correlation_matrix(double*** QInverseCorrelation, long N )
+void initialise_QI(triag_matrix** Q, long array_length, double hurst)
 {
-	// This is inverse correlation matrix of X_1...X_N with X_0 = 0 fixed.	
-	long i;
-	ALLOC( *QInverseCorrelation, N);
-	for(i = 0; i < N; i++)
-	{
-		ALLOC ( (*QInverseCorrelation)[i], ((N * (N + 1)) / 2) );
-	}
+	// *Q is only set once everything is allocated
+	triag_matrix* q;
+	ALLOC(q, 1);
+	memset(q, 0, sizeof(triag_matrix));
+	q->factor_length = (array_length*(array_length + 1) / 2); // Same footprint as a dense triangular matrix, enlarged if needed
+	ALLOC(q->factor_columns, q->factor_length);
+	ALLOC(q->factor_diagonal, array_length);
+	ALLOC(q->whitened_x, array_length);
+	ALLOC(q->trajectory_x, (array_length + 1));
+	ALLOC(q->trajectory_t, (array_length + 1));
+	q->array_length = array_length;
+	q->hurst_parameter = hurst;
+	q->size = 0;
+	q->base_size = 0;
+	q->rank = 0;
+	q->unresolved_midpoints = 0;
+	q->midpoint_catalogue = NULL; // Only needed for several drifts, see enable_midpoint_catalogue
+	q->catalogue_stamp = NULL;
+	q->stamp = 0;
+	q->catalogue_resolution = 0.0;
+	*Q = q;
+}
+
+void enable_midpoint_catalogue(triag_matrix* Q, int levels)
+{
+	// Midpoints can only sit at multiples of 2^-levels. The catalogue is only set once both arrays are allocated.
+	long i, length = (((long) pow(2, levels)) + 1);
+	double* catalogue;
+	long* stamps;
+	ALLOC(catalogue, length);
+	ALLOC(stamps, length);
+	for(i = 0; i < length; i++){stamps[i] = -1;}
+	Q->catalogue_stamp = stamps;
+	Q->midpoint_catalogue = catalogue;
+	Q->catalogue_resolution = pow(2, levels);
+}
+
+void free_QI(triag_matrix** Q)
+{
+	if(*Q == NULL) return;
+	free((*Q)->factor_columns);
+	free((*Q)->factor_diagonal);
+	free((*Q)->whitened_x);
+	free((*Q)->trajectory_x);
+	free((*Q)->trajectory_t);
+	free((*Q)->midpoint_catalogue);
+	free((*Q)->catalogue_stamp);
+	free(*Q);
+	*Q = NULL;
+}
+
+void initialise_correlation_cholesky_factor(double** QFactor, long N )
+{
+	// This is the Cholesky factor of the correlation matrix of X_1...X_N with X_0 = 0 fixed.	
+	ALLOC( *QFactor, ((N * (N + 1)) / 2) );
 }
 
 
@@ -89,32 +170,25 @@ void write_correlation(fftw_complex* correlation, double* correlation_exponents,
 	}
 }
 
-void write_inverse_correlation_matrix(double** Q, long N, double hurst)
+void write_correlation_cholesky_factor(double* Q, long N, double hurst)
 {
-	// This is a catalogue of N different correlation matrices where the n.th correlation matrix corresponds to the one of the first N points of a fBM fixed.
+	// Cholesky factor C = U^T U of the correlation matrix of the N subgrid points. In packed upper column major form, the leading n(n+1)/2 entries are the factor of the first n points, so this one factor serves as the whole catalogue.
 
 	int NN = ((int)N); // ! Long is being casted int ! Because LAPACKE needs to deal with it.
 	double delta_t = (1/ ((double) N));
 	
-	int size; // This is the size of the matrix going to go from 1 to N
-	
 	int i,j;
 	lapack_int info;
         
-	for(size = 1; size <= NN; size++)
+	for(i = 1; i <= NN; i++)
 	{
-		for(i = 1; i <= size; i++)
+		for(j=i; j <= NN; j++)
 		{
-			for(j=i; j <= size; j++)
-			{
-				Q[size-1][IJ2K((i-1),(j-1))] =  time_time_correlation( i * delta_t, j * delta_t, hurst);
-			}
+			Q[IJ2K((i-1),(j-1))] =  time_time_correlation( i * delta_t, j * delta_t, hurst);
 		}
-		info=LAPACKE_dpptrf(LAPACK_COL_MAJOR, 'U', size, Q[size-1]);
-		if(info != 0){printf("Lapack Cholesky decomposition of correlation matrix failed.\n"); exit(1);}
-		info=LAPACKE_dpptri(LAPACK_COL_MAJOR, 'U', size, Q[size-1]);
-		if(info != 0){printf("Lapack inversion of correlation matrix failed.\n"); exit(1);}
 	}
+	info=LAPACKE_dpptrf(LAPACK_COL_MAJOR, 'U', NN, Q);
+	if(info != 0){fbm_error(1, "Lapack Cholesky decomposition of correlation matrix failed.");}
 }
 
 void generate_random_vector(complex_z* randomvector, fftw_complex* rndW, fftw_complex *circulant_eigenvalues, long N, double sigma)
@@ -144,6 +218,43 @@ void generate_random_vector(complex_z* randomvector, fftw_complex* rndW, fftw_co
 	}
 }
 
+void write_noise_amplitudes(float* amplitudes, fftw_complex* circulant_eigenvalues, long N)
+{
+	// Scale of each Gaussian number in generate_random_vector, computed once per sampler for the single precision subgrid
+	long i;
+	double invN = 1/((double) N);
+	amplitudes[0] = ((float) sqrt(0.5*circulant_eigenvalues[0][0]*invN));
+	amplitudes[N] = ((float) sqrt(0.5*circulant_eigenvalues[N][0]*invN));
+	for(i = 1; i < N; i++){amplitudes[i] = ((float) sqrt(0.25*circulant_eigenvalues[i][0]*invN));}
+}
+
+void generate_random_vector_single(fftwf_complex* rndW, float* amplitudes, long N, double sigma)
+{
+	// As generate_random_vector, straight into the single precision buffer: the same Gaussian numbers in the same order, scaled in float by the amplitudes of write_noise_amplitudes. The pair drawn for i = 0 is overwritten, as there.
+	long i;
+	float x, y;
+
+	for(i = 0; i < N; i++)
+	{
+		x = ((float) gsl_ran_gaussian_ziggurat(r,sigma));
+		y = ((float) gsl_ran_gaussian_ziggurat(r,sigma));
+		rndW[i][0] = (amplitudes[i] * x);
+		rndW[i][1] = (amplitudes[i] * y);
+	}
+
+	rndW[0][0] = (amplitudes[0] * ((float) gsl_ran_gaussian_ziggurat(r,sigma)));
+	rndW[0][1] = 0.0f;
+
+	rndW[N][0] = (amplitudes[N] * ((float) gsl_ran_gaussian_ziggurat(r,sigma)));
+	rndW[N][1] = 0.0f;
+
+	for(i = 1; i < N; i++)
+	{
+		rndW[2*N-i][0] = rndW[i][0];
+		rndW[2*N-i][1] = -rndW[i][1];
+	}
+}
+
 void set_to_zero(double* pointer, long length)
 {
 	// generic function to "re-calloc" pointer
@@ -154,14 +265,14 @@ void set_to_zero(double* pointer, long length)
 	}
 }
 
-void integrate_noise(double* fracbm, fftw_complex* fracGN,double lin_drift, double frac_drift, long N, double hurst, int *last_point_index, double passage_height)
+void integrate_noise(double* fracbm, fftw_complex* fracGN, fftwf_complex* fracGNf, double tilt, double lin_drift, double frac_drift, long N, double hurst, int *last_point_index, double passage_height)
 {	
 	// Find the first point to jump over the barrier (if exists). Then throw away all points behind. Take the appropiate inverse matrix and pass it on.
 	double delta_t = (1/((double) N));
 	*last_point_index = ((int) N);
 	int i;
 
-	// Integrate up fractional gaussian noise for fbm trajectory
+	// Integrate up fractional gaussian noise for fbm trajectory. The importance sampling tilt is part of 'xfracbm', which is what the midpoints are conditioned on.
 	// Add up linear and fractional drift terms
 	double time;
 	xfracbm[0] = 0.0;
@@ -169,7 +280,7 @@ void integrate_noise(double* fracbm, fftw_complex* fracGN,double lin_drift, doub
 	for(i = 1; i <= N; i++)
 	{
 		time = (i*delta_t);
-		xfracbm[i] = xfracbm[i-1] + fracGN[i-1][0];
+		xfracbm[i] = xfracbm[i-1] + NOISE(i-1) + tilt*delta_t;
 		fracbm[i] = (xfracbm[i] + (lin_drift * time) + frac_drift*pow(time, 2*hurst));
 		if( fracbm[i] > passage_height)
 		{
@@ -180,12 +291,51 @@ void integrate_noise(double* fracbm, fftw_complex* fracGN,double lin_drift, doub
 	}
 }
 
-void find_fpt(double* fracbm, double* first_passage_times, double passage_height, long N, double epsilon, double** QCatalogue, double hurst, int last_point_index)
+void integrate_noise_drifts(fftw_complex* fracGN, fftwf_complex* fracGNf, double tilt, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, long N, double hurst, int* last_point_indices, int* max_last_point_index, double passage_height)
+{
+	// As integrate_noise, for several drifts on the same drift-free path. Integration stops once the path has crossed for every drift.
+	double delta_t = (1/((double) N));
+	int i, d, open_drifts = number_of_drifts;
+	double time, time_2h;
+	for(d = 0; d < number_of_drifts; d++){last_point_indices[d] = ((int) N);}
+	*max_last_point_index = ((int) N);
+	xfracbm[0] = 0.0;
+	for(i = 1; (i <= N) && (open_drifts > 0); i++)
+	{
+		time = (i*delta_t);
+		time_2h = pow(time, 2*hurst);
+		xfracbm[i] = xfracbm[i-1] + NOISE(i-1) + tilt*delta_t;
+		for(d = 0; d < number_of_drifts; d++)
+		{
+			if( (last_point_indices[d] == N) && ((xfracbm[i] + lin_drifts[d]*time + frac_drifts[d]*time_2h) > passage_height) && (i < N))
+			{
+				last_point_indices[d] = i;
+				open_drifts--;
+			}
+		}
+		*max_last_point_index = i;
+	}
+}
+
+void add_drift(double* fracbm, double lin_drift, double frac_drift, long N, double hurst, int last_point_index)
+{
+	// fracbm = xfracbm + drift on 0, ..., last_point_index
+	double delta_t = (1/((double) N));
+	double time;
+	int i;
+	fracbm[0] = 0.0;
+	for(i = 1; i <= last_point_index; i++)
+	{
+		time = (i*delta_t);
+		fracbm[i] = (xfracbm[i] + (lin_drift * time) + frac_drift*pow(time, 2*hurst));
+	}
+}
+
+void find_fpt(double* fracbm, double* first_passage_times, double passage_height, long N, double epsilon, double hurst, int last_point_index)
 {
-	// Find FPT knowing that first passage happens in [0, last_point_index * delta_t]
+	// Find FPT knowing that first passage happens in [0, last_point_index * delta_t]. QI has to hold (at least) the points up to last_point_index, see copy_QI.
 	int i;
 	double delta_t = (1/((double) N));
-	copy_QI(QCatalogue, last_point_index, hurst, fracbm, delta_t); // Here a local copy of QI is created that is conditioned on last_point_index
 
 	int fpt_found = 0;
 	double critical_strip = (erfcinv(2*epsilon)*(sqrt( ( (4.0/pow(2.0,2*hurst)) - 1)))*pow(delta_t, hurst)); 
@@ -235,11 +385,38 @@ void find_fpt(double* fracbm, double* first_passage_times, double passage_height
 	}
 }
 
-void fpt_to_zvar(double passage_height, double first_passage_time, double hurst)
+void write_tilt_direction(double** tilt_direction, double* tilt_norm, double* Q, long N)
+{
+	// a = C^{-1} h with h_i = t_i, from the Cholesky factor of the subgrid, and |h|^2 = h*a
+	long i;
+	lapack_int info;
+	ALLOC(*tilt_direction, N);
+	for(i = 0; i < N; i++){(*tilt_direction)[i] = ((i+1)/((double) N));}
+	info = LAPACKE_dpptrs(LAPACK_COL_MAJOR, 'U', ((int) N), 1, Q, *tilt_direction, ((int) N));
+	if(info != 0){fbm_error(1, "Lapack solve for the importance sampling tilt failed.");}
+	*tilt_norm = 0.0;
+	for(i = 0; i < N; i++){(*tilt_norm) += (((i+1)/((double) N)) * (*tilt_direction)[i]);}
+}
+
+double likelihood_ratio(fftw_complex* fracGN, fftwf_complex* fracGNf, double* tilt_direction, double tilt_norm, double tilt, long N)
+{
+	/* dP/dQ of the subgrid, where Q draws the subgrid with the additional drift tilt*t: exp(-tilt a*X - tilt^2 |h|^2 / 2), X the drift-free fBM on the whole subgrid.
+	 * The midpoints are conditioned on X + tilt*t exactly as P conditions on X, so their conditional law is the same under both measures and they do not contribute. */
+	long i;
+	double x = 0.0, ax = 0.0;
+	for(i = 1; i <= N; i++)
+	{
+		x += NOISE(i-1);
+		ax += (tilt_direction[i-1] * x);
+	}
+	return exp(-tilt*ax - 0.5*tilt*tilt*tilt_norm);
+}
+
+double fpt_to_zvar(double passage_height, double first_passage_time, double hurst)
 {
 	double zvar = 0.0;
 	if(first_passage_time > 0){zvar  = (passage_height / (sqrt(2.0) * pow(first_passage_time, hurst) ));}
-	printf("%.12f\n", zvar);
+	return zvar;
 }
 
 void initialise_critical_bridge(bridge_process** root_bridge, double rtime, double rvalue, double ltime, double lvalue, double threshold, double critical_strip, bridge_process* old_bridge)
@@ -263,7 +440,7 @@ void initialise_critical_bridge(bridge_process** root_bridge, double rtime, doub
 		(*root_bridge)->previous_root = old_bridge->root_bridge;
 
 	}; // Last Tree needs to get appended to then deleta all of them.
-	(*root_bridge)->pointer_stack = (bridge_process **) malloc( (pow(2, max_generation + 1) - 1) * sizeof( bridge_process* )); // There are up to 2^G - 1 nodes in a tree. 
+	ALLOC((*root_bridge)->pointer_stack, (pow(2, max_generation + 1) - 1)); // There are up to 2^G - 1 nodes in a tree. 
 	(*root_bridge)->pointer_stack[0] = (*root_bridge);
 	(*root_bridge)->stack_top = 1;
 }
@@ -391,7 +568,7 @@ bridge_process* split_bridge(bridge_process* parent_bridge)
 	{
 		// Make left child
 		sub_process->right_time = 0.5*( parent_bridge->left_time + parent_bridge->right_time);
-		sub_process->right_value = generate_random_conditional_midpoint( (parent_bridge->right_time), (parent_bridge->right_value), (parent_bridge->left_time), (parent_bridge->left_value));
+		sub_process->right_value = conditional_midpoint( (parent_bridge->right_time), (parent_bridge->right_value), (parent_bridge->left_time), (parent_bridge->left_value));
 		sub_process->left_time = parent_bridge->left_time;
 		sub_process->left_value = parent_bridge->left_value;
 		sub_process->generation = ((parent_bridge->generation)+1);
@@ -450,19 +627,33 @@ bridge_process* split_bridge(bridge_process* parent_bridge)
 }
 
 
+double conditional_midpoint( double right_time, double right_value, double left_time, double left_value)
+{
+	/* With several drifts on one path, a midpoint may have been drawn already while another drift was searched. Then it must be reused, not drawn again: the catalogue keeps the drift-free value of every midpoint of this sample under its dyadic index. */
+	if(QI->midpoint_catalogue == NULL){return generate_random_conditional_midpoint(right_time, right_value, left_time, left_value);}
+
+	double midtime = (0.50*(right_time + left_time));
+	double drift = (lin_drift*midtime + frac_drift*pow(midtime, 2*(QI->hurst_parameter)));
+	long index = lround(midtime * (QI->catalogue_resolution));
+	if(QI->catalogue_stamp[index] == QI->stamp){return (QI->midpoint_catalogue[index] + drift);}
+
+	double midpoint = generate_random_conditional_midpoint(right_time, right_value, left_time, left_value);
+	QI->midpoint_catalogue[index] = (midpoint - drift);
+	QI->catalogue_stamp[index] = QI->stamp;
+	return midpoint;
+}
+
 double generate_random_conditional_midpoint( double right_time, double right_value, double left_time, double left_value)
 {
 	double mean, sigma /*should be "\sigma^2" ! */, midpoint;
 	/* What's the random midpoint conditioned on being a (fractional) Brownian motion, conditioned on all points known so far?
-	The inverse correlation matrix of all pointsis stored in QI. The new point needs to be added according to mean and variance as found of that matrix. The matrix then needs to be enlarged to also include the new point. 
+	The Cholesky factor U of the correlation matrix of all points is stored in QI, together with the whitened trajectory z = U^{-T} X. With y = U^{-T} \gamma the new point has mean y*z and variance 2t^{2H} - y*y, and (y, sqrt(variance)) is exactly the column that extends U to the new point.
 	*/
 		
-	/* Matrix inversion core */
+	/* Triangular solve core */
 	long i;
 	double midtime = (0.50*(right_time + left_time));	
 	long number_of_points = QI->size;
-	set_to_zero(gamma_N_vec, number_of_points);
-	set_to_zero(g_vec, number_of_points);
 	double hurst = QI->hurst_parameter;
 	
 	// Step 1, Gamma vector
@@ -471,41 +662,45 @@ double generate_random_conditional_midpoint( double right_time, double right_val
 		gamma_N_vec[i] = time_time_correlation(midtime, QI->trajectory_t[i+1], hurst); // No cross correlation with t_0 = 0. \gamma_i = <t_i \tilde{t}> for t_i > 0
 	}
 
-	// Step 2, g-vector. g = Q * \gamma
-	cblas_dspmv(CblasColMajor, CblasUpper, ((int) number_of_points), 1.0, (QI->inv_corr_matrix),  gamma_N_vec, 1, 0, g_vec, 1);
+	// Step 2, y-vector. y = U^{-T} \gamma by forward substitution
+	solve_QI(gamma_N_vec, g_vec, number_of_points);
 
-	// Step 3, Compute mean; \mu = g * X
-	mean = cblas_ddot(number_of_points, g_vec, 1, &(QI->trajectory_x[1]), 1); // Observe offset by one.
+	// Step 3, Compute mean; \mu = y * z
+	mean = cblas_ddot(number_of_points, g_vec, 1, QI->whitened_x, 1);
 	
-	// Step 4, Compute variance; \sigma^2 = 2*t - g*x => LOSS OF SIGNIFICANCE !
-	sigma = (2.0 * pow(midtime,(2*hurst)));
+	// Step 4, Compute variance; \sigma^2 = 2*t - y*y, accumulated in extended precision
+	long double variance = (2.0L * powl(midtime,(2*hurst)));
 	for(i = 0; i < number_of_points; i++)
 	{
-		sigma -= ( g_vec[i] * gamma_N_vec[i]);
+		variance -= ( ((long double) g_vec[i]) * g_vec[i]);
+	}
+	sigma = ((double) variance);
+	// If the variance is not resolved any more, the new point is (to double precision) a function of the known ones. It is still drawn, but not added to the conditioning set, which keeps U well conditioned. No need to stop the run.
+	if( sigma <= (VARIANCE_RESOLUTION * 2.0 * pow(midtime,(2*hurst))) )
+	{
+		QI->unresolved_midpoints++;
+		midpoint = (mean + gsl_ran_gaussian_ziggurat(r, (sqrt(MAX(sigma, 0.0)))));
+		return (midpoint + lin_drift*midtime + frac_drift*pow(midtime, 2*hurst));
 	}
-	// Sanity check: Is sigma affected by floating point inaccuracies?
-	if(sigma < 0){printf("Matrix inversion limited by floating point precision. Lower grid resolution.\n"); exit(2);} // This is a very brute way of checking -- only triggers, when sigma^2 < 0, sure sign for numerical imprecision. Should be handled with care.
 
 	// Step 5, Draw normal distributed midpoint
-	midpoint = (mean + gsl_ran_gaussian_ziggurat(r, (sqrt(sigma)))); 
-	// Step 6, Save new points, enlarge matrix and save new inverse correlation matrix
-	double inv_sigma = (1./sigma);
-	// First add sigma^{-2}*g*g^T on top of Q(N)
-	cblas_dspr(CblasColMajor,CblasUpper, ((int) number_of_points), inv_sigma, g_vec, 1, QI->inv_corr_matrix); 
-	// Check if matrix needs to be enlarged.
+	double std_deviation = sqrt(sigma);
+	double whitened_midpoint = gsl_ran_gaussian_ziggurat(r, 1.0);
+	midpoint = (mean + std_deviation*whitened_midpoint); 
+	// Step 6, Save new point and append its column (y, std_deviation) to U. Nothing already stored is rewritten.
+	// Check if arrays need to be enlarged.
 	if( (QI->size) >= (QI->array_length) ){enlarge_QI();} 
-	int new_index = (QI->size); // The largest index so far was (*QI)->size , so now it\s one more
+	long new_index = (QI->size); // The largest index so far was (*QI)->size , so now it\s one more
+	long offset = ((QI->rank)*(QI->base_size) + (QI->rank)*((QI->rank) - 1)/2);
+	if( (offset + number_of_points) > (QI->factor_length) ){enlarge_QI_factor(offset + number_of_points);}
  	//Add new row with X_new (midpoint)
 	QI->trajectory_t[new_index+1] = midtime;
 	QI->trajectory_x[new_index+1] = midpoint;
 
-	// The new column has coordinates new_index*(new_index+1)/2 , ..., (new_index + 1) * (new_index + 2)/2 - 1, that is the new column has new_index + 1 entries.
-	for (i = (new_index*(new_index + 1)/2); i < (((new_index + 1)*(new_index + 2)/2) - 1); i ++)
-	{
-		// That's the column padded on the new row
-		QI->inv_corr_matrix[i] = -inv_sigma*g_vec[ i - (new_index*(new_index + 1)/2)];
-	}
-	QI->inv_corr_matrix[i] = inv_sigma; // That's the new diagonal entry
+	cblas_dcopy(((int) number_of_points), g_vec, 1, &(QI->factor_columns[offset]), 1);
+	QI->factor_diagonal[QI->rank] = std_deviation;
+	QI->whitened_x[new_index] = whitened_midpoint; // (X_new - y*z)/std_deviation
+	QI->rank++;
 	QI->size = new_index + 1; // Enlarge size.
 
 	return (midpoint + lin_drift*midtime + frac_drift*pow(midtime, 2*hurst));
@@ -534,12 +729,34 @@ void enlarge_QI()
 {
 	long old_size = QI->array_length;
 	long new_size = ((long)(ARRAY_REALLOC_FACTOR * old_size));
-	REALLOC(QI->inv_corr_matrix, ((new_size*(new_size + 1)/2)));
+	REALLOC(QI->factor_diagonal, new_size);
+	REALLOC(QI->whitened_x, new_size);
 	REALLOC(QI->trajectory_x, (new_size + 1));
 	REALLOC(QI->trajectory_t, (new_size + 1));
 	QI->array_length = new_size;
 }
 
+void enlarge_QI_factor(long required_length)
+{
+	long new_length = MAX(((long)(ARRAY_REALLOC_FACTOR * (QI->factor_length))), required_length);
+	REALLOC(QI->factor_columns, new_length);
+	QI->factor_length = new_length;
+}
+
+void solve_QI(double* vec, double* result, long number_of_points)
+{
+	// result = U^{-T} * vec by forward substitution, first through the base factor, then through the appended columns. Costs O(base_size^2 + rank*size).
+	long k, offset, length;
+	cblas_dcopy(((int) number_of_points), vec, 1, result, 1);
+	cblas_dtpsv(CblasColMajor, CblasUpper, CblasTrans, CblasNonUnit, ((int) QI->base_size), QI->base_cholesky_factor, result, 1);
+	for(k = 0; k < (QI->rank); k++)
+	{
+		length = ((QI->base_size) + k);
+		offset = (k*(QI->base_size) + k*(k - 1)/2);
+		result[length] = ((result[length] - cblas_ddot(((int) length), &(QI->factor_columns[offset]), 1, result, 1)) / QI->factor_diagonal[k]);
+	}
+}
+
 void free_tree(bridge_process** bridge)
 {
 	// Frees a "tree", so a nested sequence of generated midpoints
@@ -563,7 +780,7 @@ void free_bridge(bridge_process** bridge)
 void print_QI()
 {
 	
-	printf("===============QI============\nSIZE: %ld, ARRAY_LENGTH: %ld, ADDRESS: %p\n", QI->size, QI->array_length, QI);
+	printf("===============QI============\nSIZE: %ld, ARRAY_LENGTH: %ld, BASE: %ld, RANK: %ld, ADDRESS: %p\n", QI->size, QI->array_length, QI->base_size, QI->rank, QI);
 	long L = QI->size;
 	int i,j;
 	for(i = 0; i <= L; i++)
@@ -571,7 +788,7 @@ void print_QI()
 		printf("(%g,%g)\t",QI->trajectory_t[i], QI->trajectory_x[i]);	
 	}
 	printf("\n");
-	printf("*********** Matrix values **************\n");
+	printf("*********** Cholesky factor **************\n");
 	for(i = 0; i < L; i++)
 	{
 		for(j = 0; j < i; j++)
@@ -580,13 +797,23 @@ void print_QI()
 		}
 		for(j = i; j < L; j++)
 		{
-			printf("%g\t",QI->inv_corr_matrix[IJ2K(i,j)]);
+			printf("%g\t",QI_factor_entry(i,j));
 		}
 		printf("\n");
 	}
 	printf("***** Print QI End******\n");
 }
 
+double QI_factor_entry(long i, long j)
+{
+	// Entry (i,j), i <= j, of the Cholesky factor U, read from the base or the appended columns
+	long k;
+	if( j < QI->base_size){return QI->base_cholesky_factor[IJ2K(i,j)];}
+	k = (j - (QI->base_size));
+	if( i == j){return QI->factor_diagonal[k];}
+	return QI->factor_columns[k*(QI->base_size) + k*(k - 1)/2 + i];
+}
+
 void print_bridge(bridge_process* bridge)
 {
 	printf(" +++ Bridge +++ \n");
@@ -603,23 +830,24 @@ void print_bridge(bridge_process* bridge)
 	printf(" +++++++++++ \n");
 }
 
-void copy_QI(double **Q, int last_point_index, double hurst, double* zfracbm, double delta_t)
+void copy_QI(double *Q, int last_point_index, double delta_t)
 {
-	int i,j;
+	// Condition on the drift-free subgrid 'xfracbm' up to last_point_index. A new stamp invalidates the midpoint catalogue of the previous sample.
+	int i;
 	QI->size = last_point_index;
-	double time;
+	QI->base_size = last_point_index;
+	QI->base_cholesky_factor = Q; // The leading block of the catalogue factor is the factor of the first last_point_index points. It is not copied, midpoints only append columns.
+	QI->rank = 0;
+	QI->stamp++;
 	QI->trajectory_x[0] = 0.0;
 	QI->trajectory_t[0] = 0.0;
 	for(i = 0; i < (QI->size) ; i++)
         {
-		time = ((i+1)*delta_t);
-		QI->trajectory_x[i+1] = (zfracbm[i+1] - lin_drift*time - frac_drift*pow(time, 2*hurst));
+		QI->trajectory_x[i+1] = xfracbm[i+1];
 		QI->trajectory_t[i+1] = ((i+1)*delta_t);
-		for(j = i; j < (QI->size) ; j++)
-		{
-			QI->inv_corr_matrix[IJ2K(i,j)] = Q[last_point_index-1][IJ2K(i,j)]; // Here we are reading off the inverse correlation matrix from the previously found inverse correlation matrix.
-		}
+		QI->whitened_x[i] = QI->trajectory_x[i+1];
         }
+	cblas_dtpsv(CblasColMajor, CblasUpper, CblasTrans, CblasNonUnit, last_point_index, Q, QI->whitened_x, 1); // z = U^{-T} X
 }
 
 
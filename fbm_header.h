@@ -5,26 +5,56 @@
 // LIBRARIES
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_sf.h>
 #include <fftw3.h>
 #include <lapacke.h>
 #include <cblas.h>
+#include "fracbm.h"
 
 // MACROS
 #define IJ2K(a,b) (a+b*(b+1)/2) // Converts matrix indices
 #define ARRAY_REALLOC_FACTOR 2.0 // Factor for realloc
+#define CHECKPOINT_MAGIC "FRACBM-FPT-MC-CHECKPOINT" // First word of every checkpoint file
+#define CHECKPOINT_VERSION 9 // Also the version of result files
+#define RESULT_MAGIC "FRACBM-FPT-MC-RESULT" // First word of every result file
+#define CHECKPOINT_NAME_LENGTH 4096
+#define CHECKPOINT_INTERVAL 1000 // Default number of samples between two checkpoints
+#define PIPELINE_BLOCK 16384 // Largest number of samples collected from the pipeline between two outputs, a shorter checkpoint interval sets the block
+#define PIPELINE_WINDOW 32768 // Samples the pipeline threads may run ahead of the collected ones, a power of two
+#define PIPELINE_PATHS_PER_THREAD 4 // Subgrid paths in flight per pipeline thread
+#define PIPELINE_SPIN 1000 // Pops (or checks) a pipeline thread tries before it blocks on an empty queue (or a full window)
+#define SINGLE_PRECISION_TEST_PATHS 100 // Paths drawn in both precisions to check the single precision subgrid
+#define SINGLE_PRECISION_TEST_SAMPLES 1000 // Samples whose FPT is found in both precisions to check the single precision subgrid
+#define STREAM_DOMAIN_SAMPLES 0 // Counter domains of the per sample streams: the samples,
+#define STREAM_DOMAIN_TESTS 1 // the test paths of the single precision deviation
+#define STREAM_DOMAIN_FPT_TESTS 2 // and the test samples of the single precision FPT check
+#define VARIANCE_RESOLUTION DBL_EPSILON // Conditional variances below this fraction of the unconditioned variance are not resolved by double precision
 #define MIN(a,b) ( (a < b) ? (a) : (b))
 #define MAX(a,b) ( (a > b) ? (a) : (b))
 #define ABS(a) ((a > 0) ? (a): (-a) )
-#define ALLOC(p,n)  (p)=malloc( (n) * sizeof(*(p))); if( (p) == NULL){printf("Allocation of '%s' failed. Terminate. \n", #p); exit(2); } 
-#define FFT_ALLOC(p,n)  (p)=fftw_malloc( (n) * sizeof(*(p))); if( (p) == NULL){printf("Allocation of '%s' failed. Terminate. \n", #p); exit(2); } 
-#define REALLOC(p,n)  (p)=realloc( (p) , (n) * sizeof(*(p))); if( (p) == NULL){printf("Allocation of '%s' failed. Terminate. \n", #p); exit(2); } 
+#define NOISE(i) ( (fracGNf != NULL) ? ((double) fracGNf[i][0]) : fracGN[i][0]) // Increment i of the subgrid, from the single precision FFT output if there is one (fracGN is not allocated then)
+#define ALLOC(p,n)  (p)=malloc( (n) * sizeof(*(p))); if( (p) == NULL){fbm_error(2, "Allocation of '%s' failed.", #p); } 
+#define FFT_ALLOC(p,n)  (p)=fftw_malloc( (n) * sizeof(*(p))); if( (p) == NULL){fbm_error(2, "Allocation of '%s' failed.", #p); } 
+#define FFTF_ALLOC(p,n)  (p)=fftwf_malloc( (n) * sizeof(*(p))); if( (p) == NULL){fbm_error(2, "Allocation of '%s' failed.", #p); } 
+#define REALLOC(p,n)  {void* reallocated = realloc( (p) , (n) * sizeof(*(p))); if(reallocated == NULL){fbm_error(2, "Allocation of '%s' failed.", #p); } (p) = reallocated;} // p stays valid if it fails
+#define ERROR_MESSAGE_LENGTH 256
+// Library entry points: an fbm_error below them returns here, and the entry point returns error_value instead of the program being terminated
+#define CATCH_ERRORS(error_value) jmp_buf handler; jmp_buf* caller_handler = error_handler; if(setjmp(handler) != 0){error_handler = caller_handler; return error_value;} error_handler = &handler;
+#define END_CATCH_ERRORS error_handler = caller_handler;
 
 // STRUCT
 // Complex numbers
@@ -56,53 +86,259 @@ typedef struct bridge_process // This is the bridge process spanned by two midpo
 
 typedef struct triag_matrix
 {
-	/* This struct stores a sequence of points X_1, X_2, ... and their inverse correlation matrix. It can be dynamically managed as points are added. Convention for triagonal matrix: column major form and 'upper' triagonal form.*/
-	long size; // This is the size of the matrix itself, that is 0, 1, ..., size - 1 are array indices for both vectors 'trajectory_x' and 'trajectory_t', and 0, 1, ..., size*(size+1)/2 - 1 are indices for upper triagonal matrix. Note that size=N, meanwhile fracbm has N+1 entries. So size is the number of 'free' points, the first one being fixed.
-	long array_length; // This is the length of the array. If size gets to large, realloc. If size == array_length, this array is full.
-	double * inv_corr_matrix; // ( size * ( size + 1) / 2) entries in symmetric inverse correlation matrix of all points already known
-	double * trajectory_x; // All points of the trajectory already known. Length = size + 1 (X_0 = 0 doesn't count, and is neglected in inverse correlation matrix (null mode)). 
+	/* This struct stores a sequence of points X_1, X_2, ... and the Cholesky factor of their correlation matrix. It can be dynamically managed as points are added. Convention for triagonal matrix: column major form and 'upper' triagonal form, C = U^T U.
+	 * The factor of the subgrid points X_1, ..., X_{base_size} is the leading block of the catalogue factor and is only read. Every conditioned midpoint appends one column to U: its entries above the diagonal are y = U^{-T} gamma, the diagonal entry is the conditional standard deviation. No inverse is ever formed. */
+	long size; // This is the size of the matrix itself, that is 0, 1, ..., size - 1 are array indices for both vectors 'trajectory_x' and 'trajectory_t'. Note that size=N, meanwhile fracbm has N+1 entries. So size is the number of 'free' points, the first one being fixed.
+	long array_length; // This is the length of the trajectory arrays. If size gets to large, realloc. If size == array_length, this array is full.
+	long base_size; // Number of subgrid points covered by 'base_cholesky_factor'
+	const double * base_cholesky_factor; // ( base_size * ( base_size + 1) / 2) entries of the Cholesky factor of the subgrid points. Points into the catalogue, never written.
+	long rank; // Number of appended columns, rank = size - base_size
+	double * factor_columns; // Appended columns above the diagonal, packed one after another. Column k has (base_size + k) entries and starts at k*base_size + k*(k-1)/2.
+	long factor_length; // Allocated length of 'factor_columns'
+	double * factor_diagonal; // Diagonal entries of the appended columns. Length = array_length
+	double * whitened_x; // U^{-T} X of all points already known. Length = array_length
+	double * trajectory_x; // All points of the trajectory already known. Length = size + 1 (X_0 = 0 doesn't count, and is neglected in the correlation matrix (null mode)). 
 	double * trajectory_t; // And the corresponding time points. Length = size + 1
 	double hurst_parameter;
+	long unresolved_midpoints; // Midpoints whose conditional variance fell below VARIANCE_RESOLUTION
+	double * midpoint_catalogue; // Drift-free midpoints of the current sample by dyadic index t * catalogue_resolution. NULL unless several drifts share the path.
+	long * catalogue_stamp; // An entry is valid if its stamp equals 'stamp'
+	long stamp; // Counts samples, increased by copy_QI
+	double catalogue_resolution;
 } triag_matrix;
 
+typedef struct fpt_statistics
+{
+	/* Running aggregates of the ensemble. They are sums, so that runs and checkpoints can be continued exactly. All sums except 'passages' are weighted with the likelihood ratio of each sample (= 1 without importance sampling). */
+	long samples;
+	long passages; // Samples with a first passage before t = 1
+	double sum_weight;
+	double sum_weight_squared; // For the effective sample size (sum w)^2 / sum w^2
+	double sum_passages; // sum w * 1{FPT < 1}
+	double sum_passages_squared;
+	double sum_fpt; // Censored FPTs (= 1.0 without passage)
+	double sum_fpt_squared;
+	double sum_zvar;
+	double sum_zvar_squared;
+} fpt_statistics;
+
+typedef struct fbm_path
+{
+	// One Davies-Harte subgrid on its way from a producer to a consumer thread
+	long index; // Sample index, relative to the first sample of the call
+	double weight; // Likelihood ratio
+	double * xfracbm; // Drift-free subgrid, N + 1 points
+	int * last_point_index; // One per drift, as from integrate_noise_drifts
+	int max_last_point_index;
+} fbm_path;
+
+typedef struct fbm_queue_cell
+{
+	atomic_long sequence;
+	fbm_path * path;
+} fbm_queue_cell;
+
+typedef struct fbm_queue
+{
+	/* Bounded ring buffer for several producers and consumers, without locks. A cell may be written when its sequence equals the write position, and read when it equals the read position + 1; the sequence then moves on by one lap.
+	 * Capacity is a power of two. Head and tail sit on separate cache lines. */
+	fbm_queue_cell * cells;
+	long capacity;
+	char pad_tail[64];
+	atomic_long tail; // Next write position
+	char pad_head[64];
+	atomic_long head; // Next read position
+	char pad_end[64];
+	atomic_int waiting; // Threads blocked in queue_wait_pop
+	pthread_mutex_t lock; // Only for blocking and waking, push and pop do not take it
+	pthread_cond_t pushed;
+} fbm_queue;
+
+typedef struct fbm_pipeline
+{
+	/* One range of samples, from fbm_sampler_start_parallel to fbm_sampler_stop_parallel, shared by its threads. The threads keep running while the caller collects the results.
+	 * Results go to a ring of 'window' slots, sample k to slot k mod window; a producer only starts sample k once sample k - window has been collected. */
+	struct fbm_sampler * sampler;
+	long first_index;
+	long n;
+	int number_of_drifts;
+	const double * lin_drifts;
+	const double * frac_drifts;
+	int producers;
+	int consumers;
+	pthread_t * threads;
+	int started; // Threads running, 0 draws the samples on the collecting thread
+	fbm_path * paths;
+	long number_of_paths;
+	fbm_queue full_paths; // Generated, waiting for the bisection
+	fbm_queue free_paths; // Buffers to generate into
+	long window;
+	double * first_passage_times; // Result ring, number_of_drifts per slot
+	double * weights;
+	long * unresolved_midpoints; // Of the sample in the slot
+	atomic_long * finished; // k + 1 once sample k is in the slot
+	atomic_long next_index; // Next sample to be generated
+	atomic_long completed; // Samples finished by the consumers
+	atomic_long collected; // Samples copied out by fbm_sampler_collect_parallel
+	atomic_int stop; // Set when all samples are finished or the pipeline is stopped, releases the blocked threads
+	atomic_int failed; // Set by the first thread that fails, the pipeline then stops
+	char error_message[ERROR_MESSAGE_LENGTH]; // of that thread
+	atomic_int waiting; // Threads blocked in pipeline_wait_window or pipeline_wait_result
+	pthread_mutex_t lock; // Only for blocking and waking, as in fbm_queue
+	pthread_cond_t progress; // A sample was finished or collected
+	int lock_initialised;
+} fbm_pipeline;
+
+typedef struct stream_rng_state // State of the counter-based generator of the per sample streams, a gsl_rng type
+{
+	uint32_t key[2]; // (seed, stream)
+	uint32_t counter[4]; // (block number, 0, domain)
+	uint32_t block[4]; // Numbers of the previous counter
+	int used; // Numbers of block already returned
+} stream_rng_state;
+
+typedef struct fbm_worker
+{
+	/* Buffers of one pipeline thread, kept by the sampler between calls. Producers need the FFT buffers of the sampler's precision, consumers the conditioning workspace, each is allocated when first needed.
+	 * Eigenvalues, FFT plan, Cholesky factor and tilt are read only and shared with the sampler. */
+	fftw_complex *rndW, *fracGN;
+	fftwf_complex *rndWf, *fracGNf;
+	complex_z *randomComplexGaussian;
+	double *fracbm, *gamma_N_vec, *g_vec;
+	triag_matrix *QI;
+	gsl_rng *r;
+	fbm_pipeline *pipeline; // The pipeline it currently works for
+} fbm_worker;
+
+struct fbm_sampler
+{
+	/* Everything one run needs. The sampler owns its buffers, and points the global working variables below at its own before it samples. */
+	fbm_parameters params; // seed is the one actually used
+	int subgrid_levels; // N = 2^subgrid_levels points are drawn by Davies-Harte
+	int bisection_levels; // and refined by up to bisection_levels bisections
+	long N;
+	fftw_complex *correlation, *circulant_eigenvalues, *rndW, *fracGN;
+	double *correlation_exponents, *fracbm, *xfracbm, *QCholeskyFactor;
+	complex_z *randomComplexGaussian;
+	fftw_plan p1, p2;
+	fftwf_complex *rndWf, *fracGNf; // Single precision subgrid (FBM_SINGLE_SUBGRID): drawn, transformed and integrated from these, rndW, fracGN and randomComplexGaussian are not allocated
+	float *noise_amplitudes; // Scales of the Gaussian numbers, see write_noise_amplitudes
+	fftwf_plan p2f;
+	int *drift_last_point_index; // Workspace for several drifts
+	int drift_workspace_length;
+	double *tilt_direction, tilt_norm; // a = C^{-1} t of the subgrid and t*a, for the likelihood ratio
+	double *gamma_N_vec, *g_vec;
+	triag_matrix *QI;
+	const gsl_rng_type *T;
+	gsl_rng *r;
+	fbm_worker *workers; // Threads of the pipeline
+	int number_of_workers;
+	fbm_pipeline *pipeline; // Running pipeline, NULL if none
+};
+
 // FUNCTIONS
-void initialise( fftw_complex** ,  fftw_complex** , fftw_complex** ,  fftw_complex** ,  double** , complex_z** , long N, gsl_rng**, const gsl_rng_type**, int);
-void initialise_trajectory ( double**, long);
-void initialise_inverse_correlation_matrix(double***, long );
+void initialise( fftw_complex** ,  fftw_complex** , fftw_complex** ,  fftw_complex** ,  double** , complex_z** , long N, gsl_rng**, const gsl_rng_type**, int*, int);
+void initialise_trajectory ( double**, double**, long);
+void initialise_QI(triag_matrix**, long, double);
+void enable_midpoint_catalogue(triag_matrix*, int);
+void activate_sampler(fbm_sampler*);
+void free_QI(triag_matrix**);
+void initialise_correlation_cholesky_factor(double**, long );
 double erfcinv(double);
 void write_correlation_exponents(double*, long, double, double);
 void write_correlation(fftw_complex*, double*, long);
-void write_inverse_correlation_matrix(double **, long, double);
+void write_correlation_cholesky_factor(double *, long, double);
 void generate_random_vector(complex_z*, fftw_complex*, fftw_complex*,long, double);
+void write_noise_amplitudes(float*, fftw_complex*, long);
+void generate_random_vector_single(fftwf_complex*, float*, long, double);
+int compare_doubles(const void*, const void*);
+void draw_subgrid_noise(fbm_sampler*, complex_z*, fftw_complex*, fftw_complex*, fftwf_complex*, fftwf_complex*);
 void set_to_zero(double*, long);
-void integrate_noise(double*, fftw_complex*, double, double, long, double, int*, double);
-void find_fpt(double*, double*, double, long, double, double**, double, int);
-void fpt_to_zvar(double, double, double);
+void integrate_noise(double*, fftw_complex*, fftwf_complex*, double, double, double, long, double, int*, double);
+void integrate_noise_drifts(fftw_complex*, fftwf_complex*, double, int, const double*, const double*, long, double, int*, int*, double);
+void add_drift(double*, double, double, long, double, int);
+void find_fpt(double*, double*, double, long, double, double, int);
+void write_tilt_direction(double**, double*, double*, long);
+double likelihood_ratio(fftw_complex*, fftwf_complex*, double*, double, double, long);
+double fpt_to_zvar(double, double, double);
 void initialise_critical_bridge(bridge_process**, double, double, double, double, double, double, bridge_process*);
 void split_and_search_bridge(bridge_process*, int*, double*,  double);
 
 bridge_process* check_this_bridge(bridge_process*, double*, double);
 bridge_process* split_bridge(bridge_process*);
+double conditional_midpoint(double, double, double, double);
 double generate_random_conditional_midpoint(double, double, double, double);
 double crossing_time_of_bridge(bridge_process*);
 double time_time_correlation(double, double, double);
 
 void enlarge_QI(void);
+void enlarge_QI_factor(long);
+void solve_QI(double*, double*, long);
+double QI_factor_entry(long, long);
 void print_QI(void);
 void print_bridge(bridge_process*);
-void copy_QI(double**, int, double, double*, double );
+void copy_QI(double*, int, double );
 void free_tree(bridge_process**);
 void free_bridge(bridge_process**);
 
+// Errors (fbm_functions.c)
+void set_error_message(const char*, ...);
+void fbm_error(int, const char*, ...) __attribute__((noreturn));
+
+// Statistics and checkpoints (fbm_checkpoint.c)
+void initialise_statistics(fpt_statistics*);
+void update_statistics(fpt_statistics*, double, double, double);
+void print_statistics(fpt_statistics*);
+int compatible_parameters(fbm_parameters*, fbm_parameters*);
+void write_statistics(FILE*, fpt_statistics*);
+int read_statistics(FILE*, fpt_statistics*);
+void write_parameters(FILE*, fbm_parameters*);
+int read_parameters(FILE*, fbm_parameters*);
+void write_drift_statistics(FILE*, int, const double*, const double*, fpt_statistics*);
+int read_drift_statistics(FILE*, int*, double**, double**, fpt_statistics**);
+FILE* open_replacement(const char*, char*);
+void close_replacement(FILE*, const char*, const char*);
+void write_checkpoint(const char*, fbm_sampler*, long, long, int, long, int, const double*, const double*, fpt_statistics*);
+void read_checkpoint(const char*, fbm_parameters*, long*, long*, int*, long*, int, const double*, const double*, fpt_statistics*, fbm_sampler*);
+void write_result(const char*, fbm_parameters*, long, int, int, long, long, long, int, int, const double*, const double*, fpt_statistics*);
+void read_result(const char*, fbm_parameters*, long*, int*, int*, long*, long*, long*, int*, int*, double**, double**, fpt_statistics**);
+void add_statistics(fpt_statistics*, fpt_statistics*);
+void philox4x32_10(const uint32_t*, const uint32_t*, uint32_t*);
+void stream_rng_set(void*, unsigned long);
+unsigned long stream_rng_get(void*);
+double stream_rng_get_double(void*);
+void set_sample_stream(gsl_rng*, int, unsigned long, uint32_t);
+void initialise_queue(fbm_queue*, long);
+int queue_push(fbm_queue*, fbm_path*);
+int queue_pop(fbm_queue*, fbm_path**);
+void queue_wake(fbm_queue*);
+int queue_wait_pop(fbm_queue*, fbm_path**, atomic_int*);
+void free_queue(fbm_queue*);
+void prepare_producer(fbm_worker*, fbm_sampler*);
+void prepare_consumer(fbm_worker*, fbm_sampler*, int);
+void produce_path(fbm_worker*, fbm_path*, long);
+void activate_worker(fbm_worker*);
+void consume_path(fbm_worker*, fbm_path*);
+void pipeline_wake(fbm_pipeline*);
+int pipeline_wait_window(fbm_pipeline*, long);
+int pipeline_wait_result(fbm_pipeline*, long);
+void pipeline_fail(fbm_pipeline*);
+void* producer_thread(void*);
+void* consumer_thread(void*);
+void free_worker(fbm_worker*);
+void free_pipeline(fbm_pipeline*);
+
 // GLOBAL VARIABLES
-extern int max_generation;
-extern double *gamma_N_vec;
-extern double *g_vec;
-extern double lin_drift, frac_drift; // Additional linear and fractional drift constants: Z_t = X_t + lin_drift * t + frac_drift * t^(2*hurst). FPT is searched for Z_t.
-extern double *xfracbm; // The fBM trajectory with *no* drift is 'xfracbm'. The process with drift is labelled 'fracbm'. 
+// Thread local, so that samplers (and the threads of the pipeline) can work on different threads at the same time
+extern __thread int max_generation;
+extern __thread double *gamma_N_vec;
+extern __thread double *g_vec; // y = U^{-T} gamma
+extern __thread double lin_drift, frac_drift; // Additional linear and fractional drift constants: Z_t = X_t + lin_drift * t + frac_drift * t^(2*hurst). FPT is searched for Z_t.
+extern __thread double *xfracbm; // The fBM trajectory with *no* drift is 'xfracbm'. The process with drift is labelled 'fracbm'. 
 
 // GSL RNG
-extern const gsl_rng_type *T;
-extern gsl_rng *r;
-extern int seed;
-extern triag_matrix *QI; //malloc somewhere
+extern __thread gsl_rng *r;
+extern __thread jmp_buf *error_handler; // Set by the library entry points, NULL in the command line tools
+extern __thread char error_message[ERROR_MESSAGE_LENGTH];
+extern const gsl_rng_type* stream_rng_type; // Philox4x32-10 (fbm_pipeline.c)
+extern __thread triag_matrix *QI; //malloc somewhere
@@ -9,16 +9,6 @@
 
 #include "fbm_header.h"
 
-// Global variable
-int max_generation;
-triag_matrix *QI;
-double lin_drift, frac_drift;
-
-// GSL RNG
-const gsl_rng_type *T;
-gsl_rng *r;
-int seed;
-
 
 
 int main(int argc, char *argv[])
@@ -36,17 +26,39 @@ int main(int argc, char *argv[])
 	
 	// Simulation parametre
 	int iteration = 10000;	// Size of ensemble
-	int iter;
+	long iter, k, block;
+	int consumers = 0; // Threads for the bisection (-j), 0 samples on the main thread
+	int producers = 0; // Threads for the subgrids, by default one per four consumers
+	int sharded = 0; // --shard i/n runs the i-th of n parts of the ensemble
+	int shard = 0, shards = 1;
+	int consumed; // Characters of the shard argument parsed
+	char *result_file = NULL; // Parameters and aggregates of the run, for fbm-merge
 	
 	// observables
 	double passage_heights = 0.1; // Height of absorbing barrier (needs to be > 0).
-	double first_passage_times = 0.0;
+	double tilt = 0.0; // Importance sampling drift, 0 = off
+	int coarse_levels = 0; // Levels of the subgrid left to the bisection (coarse-to-fine mode)
 	int seed = -1; // RNG seed
+	int single_precision = 0; // Subgrid in single precision (--single)
+	int single_check = 0; // Compare it with double precision before the run (--single-check)
+
+	// Several drifts on the same paths (-D), otherwise the single drift of -m and -n
+	int number_of_drifts = 0;
+	double *lin_drifts = NULL;
+	double *frac_drifts = NULL;
+	char *separator;
+
+	// Checkpointing
+	char *output_file = NULL; // Samples go to stdout unless a file is given
+	char *checkpoint_file = NULL;
+	int checkpoint_interval = CHECKPOINT_INTERVAL;
+	int resume = 0;
+	static struct option long_options[] = { {"resume", no_argument, NULL, 'R'}, {"producers", required_argument, NULL, 'P'}, {"single", no_argument, NULL, 'F'}, {"single-check", no_argument, NULL, 'V'}, {"shard", required_argument, NULL, 'K'}, {"result", required_argument, NULL, 'O'}, {NULL, 0, NULL, 0} };
 
 	// input
 	opterr = 0;
 	int c = 0;
-        while( (c = getopt (argc, argv, "h:g:G:S:I:m:n:E:") ) != -1)
+        while( (c = getopt_long (argc, argv, "h:g:G:S:I:m:n:D:E:B:T:L:o:C:c:j:", long_options, NULL) ) != -1)
 	{                switch(c)
                         {
 				case 'm':
@@ -55,6 +67,16 @@ int main(int argc, char *argv[])
                         	case 'n':
 					frac_drift = (- ( double) atof(optarg));
 					break;
+				case 'D':
+					// mu:nu, with the sign convention of -m and -n
+					separator = strchr(optarg, ':');
+					if(separator == NULL){fprintf(stderr, "Drift '%s' is not of the form mu:nu. Terminate.\n", optarg); exit(EXIT_FAILURE);}
+					number_of_drifts++;
+					REALLOC(lin_drifts, number_of_drifts);
+					REALLOC(frac_drifts, number_of_drifts);
+					lin_drifts[number_of_drifts - 1] = ( - ( double) atof(optarg));
+					frac_drifts[number_of_drifts - 1] = ( - ( double) atof(separator + 1));
+					break;
                                 case 'h':
                                         hurst = atof(optarg);
                                         break;
@@ -63,6 +85,7 @@ int main(int argc, char *argv[])
 					break;
 				case 'G':
 					max_generation = atoi(optarg);
+					break;
 				case 'S':
 					seed = atoi(optarg);
 					break;
@@ -72,79 +95,206 @@ int main(int argc, char *argv[])
 				case 'E':
 					epsilon = atof(optarg);
 					break;
+				case 'B':
+					passage_heights = atof(optarg);
+					break;
+				case 'T':
+					tilt = atof(optarg);
+					break;
+				case 'L':
+					coarse_levels = atoi(optarg);
+					break;
+				case 'o':
+					output_file = optarg;
+					break;
+				case 'C':
+					checkpoint_file = optarg;
+					break;
+				case 'c':
+					checkpoint_interval = atoi(optarg);
+					break;
+				case 'R':
+					resume = 1;
+					break;
+				case 'j':
+					consumers = atoi(optarg);
+					break;
+				case 'P':
+					producers = atoi(optarg);
+					break;
+				case 'F':
+					single_precision = 1;
+					break;
+				case 'V':
+					single_check = 1;
+					break;
+				case 'K':
+					sharded = 1;
+					consumed = 0;
+					// Decimal only, and nothing may follow n
+					if( (sscanf(optarg, "%d/%d%n", &shard, &shards, &consumed) != 2) || (optarg[consumed] != '\0')){fprintf(stderr, "Shard '%s' is not of the form i/n. Terminate.\n", optarg); exit(EXIT_FAILURE);}
+					break;
+				case 'O':
+					result_file = optarg;
+					break;
                        		default:
                                 exit(EXIT_FAILURE);
                         }
 	}// getopt ends
 
-	long N = ((long) pow(2,g));
-	double invN = 1/(( double) N);
-	double sigma = 1.0;//sqrt(2.0);
+	if( resume && ( (checkpoint_file == NULL) || (output_file == NULL)) ){fprintf(stderr, "--resume needs the checkpoint (-C) and the output file (-o) of the interrupted run. Terminate.\n"); exit(EXIT_FAILURE);}
+	if( checkpoint_interval <= 0){fprintf(stderr, "Checkpoint interval must be positive. Terminate.\n"); exit(EXIT_FAILURE);}
+	if( (consumers < 0) || (producers < 0) || ( (producers > 0) && (consumers == 0))){fprintf(stderr, "Thread counts must be positive, --producers needs -j. Terminate.\n"); exit(EXIT_FAILURE);}
+#ifndef FBM_SINGLE_SUBGRID
+	if(single_precision){fprintf(stderr, "--single needs a build with single precision FFTW (make SINGLE=1). Terminate.\n"); exit(EXIT_FAILURE);}
+#endif
+	if( single_check && !single_precision){fprintf(stderr, "--single-check needs --single. Terminate.\n"); exit(EXIT_FAILURE);}
+	if( sharded && ( (shards < 1) || (shard < 0) || (shard >= shards))){fprintf(stderr, "Shard i/n needs 0 <= i < n. Terminate.\n"); exit(EXIT_FAILURE);}
+	if( sharded && (seed == -1)){fprintf(stderr, "--shard needs a seed (-S), the same for all shards. Terminate.\n"); exit(EXIT_FAILURE);}
+	int sample_streams = ( (consumers > 0) || sharded); // The pipeline, and shards, draw every sample from its own RNG streams, keyed by (seed, sample) and disjoint from those of any other sample or seed
+	if( (consumers > 0) && (producers == 0)){producers = MAX(1, consumers / 4);}
+	if( output_file != NULL)
+	{
+		// On resume the file is opened in place and cut back to the last checkpoint, otherwise it is started afresh
+		if( freopen(output_file, (resume ? "r+" : "w"), stdout) == NULL){fprintf(stderr, "Cannot open output file '%s'. Terminate.\n", output_file); exit(2);}
+		setlinebuf(stdout);
+	}
 
-	printf("# FRACBM-FPT-MC (2019)\n# Simulation Parameters\n# Hurst parameter: %g, Subgridsize: %ld \n", hurst, N);	
-	fftw_complex *correlation, *circulant_eigenvalues, *rndW, *fracGN;
-       	double *correlation_exponents, *fracbm, **QInverseCorrelationCatalogue;
-	complex_z *randomComplexGaussian;
-	fftw_plan p1, p2 ;
+	int multiple_drifts = (number_of_drifts > 0);
+	if(!multiple_drifts)
+	{
+		number_of_drifts = 1;
+		ALLOC(lin_drifts, 1);
+		ALLOC(frac_drifts, 1);
+		lin_drifts[0] = lin_drift;
+		frac_drifts[0] = frac_drift;
+	}
+	fpt_statistics *stats;
+	ALLOC(stats, number_of_drifts);
+	// Results of the pipeline are collected in blocks of at most PIPELINE_BLOCK samples, after which output, statistics and checkpoints are written. The threads keep running meanwhile.
+	long block_length = ( sample_streams ? MIN(checkpoint_interval, PIPELINE_BLOCK) : 1);
+	double *first_passage_times, *weights;
+	ALLOC(first_passage_times, (block_length * number_of_drifts));
+	ALLOC(weights, block_length);
+	int d;
+	for(d = 0; d < number_of_drifts; d++){initialise_statistics(&(stats[d]));}
 
-	
-	// Initialise observables
-	initialise(&correlation, &circulant_eigenvalues, &rndW, &fracGN, &correlation_exponents, &randomComplexGaussian, N, &r, &T, seed);
-	initialise_trajectory(&fracbm, N);
-	initialise_inverse_correlation_matrix(&QInverseCorrelationCatalogue, N);
-
-	//Initialise global observables
-	ALLOC(gamma_N_vec, pow(2, (g+max_generation))); // Maximal number of points possible
-	ALLOC(g_vec, pow(2,(g+max_generation)));
-	long array_length = 2*N;
-	ALLOC(QI, 1);
-	ALLOC(QI->inv_corr_matrix, (array_length*(array_length + 1) / 2));
-	ALLOC(QI->trajectory_x, (array_length + 1));
-	ALLOC(QI->trajectory_t, (array_length + 1));
-	QI->array_length = array_length;
-	QI->hurst_parameter = hurst;
-
-	// Initialise FFT plans
-	p1 = fftw_plan_dft_1d(2*N , correlation, circulant_eigenvalues, FFTW_FORWARD, FFTW_ESTIMATE);
-	p2 = fftw_plan_dft_1d(2*N, rndW, fracGN, FFTW_BACKWARD, FFTW_ESTIMATE);
-	
-	
-	// Print out header
-	printf("# Linear drift (mu): %g\n# Fractional drift (nu): %g\n# Barrier height at %g\n# Effective system size = 2^(%i) \n", lin_drift, frac_drift, passage_heights, (g+max_generation));	
-	
-	// Write correlation of noise
-	write_correlation_exponents(correlation_exponents, N, invN, hurst);
-	write_correlation(correlation, correlation_exponents, N);
-	
-	// Write Inverse of correlation matrix of FBM ('Q'(N)-matrix)
-	write_inverse_correlation_matrix(QInverseCorrelationCatalogue, N, hurst);	
-		
-	// FFT into circulant eigenvalues
-	fftw_execute(p1); 
-	
-	int last_point_index; // Index of the first point to cross the barrier (=N, if this doesn't happen)
+	long N = ((long) pow(2,(g - coarse_levels)));
 
-	for(iter = 0; iter < iteration; iter++)
+	if(!resume){printf("# FRACBM-FPT-MC (2019)\n# Simulation Parameters\n# Hurst parameter: %g, Subgridsize: %ld \n", hurst, N);}
+
+	// Initialise sampler: subgrid, FFT plans, Cholesky factor of correlation matrix of FBM
+	fbm_parameters params = { hurst, g, max_generation, epsilon, lin_drift, frac_drift, passage_heights, seed, coarse_levels, tilt, single_precision };
+	fbm_sampler *sampler = fbm_sampler_create(&params);
+	if(sampler == NULL){fprintf(stderr, "%s Terminate.\n", fbm_error_message()); exit(EXIT_FAILURE);}
+	params.seed = sampler->params.seed; // -1 is replaced by the seed taken from the clock
+
+	// A shard covers the samples [first_sample, last_sample) of the ensemble. Since every sample has its own streams, the shards together give the same samples as one run.
+	long first_sample = ((((long) shard) * iteration) / shards);
+	long last_sample = ((((long) (shard + 1)) * iteration) / shards);
+
+	// Restore the interrupted run, or print out header
+	long completed = first_sample; // Index of the next sample
+	long output_offset = 0;
+	long last_checkpoint; // A checkpoint is written at the first block end at least checkpoint_interval samples after the last one
+	if(resume)
 	{
-		
-		generate_random_vector(randomComplexGaussian, rndW, circulant_eigenvalues, N, sigma);
-		
-		fftw_execute(p2);	
-		
-		// Reset first passage times
-		first_passage_times = 0.0;
-		// Integrate fractional Gaussain noise to fBM
-		integrate_noise(fracbm, fracGN, lin_drift, frac_drift, N, hurst, &last_point_index, passage_heights);
-		
-		// Find maximum to recursive depth RECURSION_DEPTH
-		find_fpt(fracbm, &first_passage_times, passage_heights, N, epsilon,  QInverseCorrelationCatalogue, hurst, last_point_index);
-		
+		fbm_parameters checkpoint_params;
+		int checkpoint_streams;
+		long checkpoint_first_sample;
+		read_checkpoint(checkpoint_file, &checkpoint_params, &completed, &output_offset, &checkpoint_streams, &checkpoint_first_sample, number_of_drifts, lin_drifts, frac_drifts, stats, sampler);
+		if(checkpoint_streams != sample_streams){fprintf(stderr, "Checkpoint '%s' was written %s per sample RNG streams (-j, --shard), the run has to be resumed the same way. Terminate.\n", checkpoint_file, (checkpoint_streams ? "with" : "without")); exit(EXIT_FAILURE);}
+		if(checkpoint_first_sample != first_sample){fprintf(stderr, "Checkpoint '%s' belongs to a shard starting at sample %ld, not %ld. Terminate.\n", checkpoint_file, checkpoint_first_sample, first_sample); exit(EXIT_FAILURE);}
+		if(seed == -1){params.seed = sampler->params.seed = checkpoint_params.seed;} // The seed of the original run, its RNG state has just been restored
+		if(!compatible_parameters(&params, &checkpoint_params)){fprintf(stderr, "Checkpoint '%s' was written with different simulation parameters. Terminate.\n", checkpoint_file); exit(EXIT_FAILURE);}
+		if( (fflush(stdout) != 0) || (ftruncate(fileno(stdout), output_offset) != 0) || (fseek(stdout, output_offset, SEEK_SET) != 0)){fprintf(stderr, "Cannot rewind output file '%s' to the checkpoint. Terminate.\n", output_file); exit(2);}
+		printf("# Resumed from checkpoint after %ld samples\n", (completed - first_sample));
+	}
+	else
+	{
+		printf("# RNG Seed %i\n",params.seed);
+		if(multiple_drifts)
+		{
+			printf("# Drifts (mu, nu), one column each:");
+			for(d = 0; d < number_of_drifts; d++){printf(" (%g, %g)", lin_drifts[d], frac_drifts[d]);}
+			printf("\n# Barrier height at %g\n# Effective system size = 2^(%i) \n", passage_heights, (g+max_generation));
+		}
+		else{printf("# Linear drift (mu): %g\n# Fractional drift (nu): %g\n# Barrier height at %g\n# Effective system size = 2^(%i) \n", lin_drift, frac_drift, passage_heights, (g+max_generation));}
+		if(coarse_levels > 0){printf("# Coarse-to-fine: %i levels of the 2^%i subgrid refined by bisection where needed\n", coarse_levels, g);}
+		if(single_check)
+		{
+			// About as much work as 2*SINGLE_PRECISION_TEST_SAMPLES samples, so only on request
+			double critical_strip;
+			double deviation = fbm_sampler_single_precision_deviation(sampler, SINGLE_PRECISION_TEST_PATHS, &critical_strip);
+			if(deviation < 0.0){fprintf(stderr, "%s Terminate.\n", fbm_error_message()); exit(2);}
+			printf("# Single precision subgrid: largest deviation from double precision over %i test paths %g, critical strip %g (ratio %g)\n", SINGLE_PRECISION_TEST_PATHS, deviation, critical_strip, (deviation / critical_strip));
+			int differing;
+			double ks_distance, mean_difference, passage_single, passage_double;
+			if(fbm_sampler_single_precision_check(sampler, SINGLE_PRECISION_TEST_SAMPLES, &differing, &ks_distance, &mean_difference, &passage_single, &passage_double) != 0){fprintf(stderr, "%s Terminate.\n", fbm_error_message()); exit(2);}
+			printf("# Single precision FPTs of %i test samples, same random numbers as in double precision: %i cross in another interval, Kolmogorov-Smirnov distance %g, mean FPT difference %g, P(FPT < 1) %g (single) vs %g (double)", SINGLE_PRECISION_TEST_SAMPLES, differing, ks_distance, mean_difference, passage_single, passage_double);
+			if(differing == 0){printf(", a sample changes with probability < %g (95%% confidence)", (3.0 / SINGLE_PRECISION_TEST_SAMPLES));}
+			printf("\n");
+		}
+		if(sharded){printf("# Shard %i of %i: samples %ld to %ld of %i\n", shard, shards, first_sample, (last_sample - 1), iteration);}
+		if(sample_streams)
+		{
+			printf("# Every sample drawn from its own RNG streams");
+			if(consumers > 0){printf(", pipeline of %i subgrid and %i bisection threads", producers, consumers);}
+			printf("\n");
+		}
+		if(tilt != 0.0){printf("# Importance sampling: subgrid drawn with additional drift %g * t, last column is the likelihood ratio\n", tilt);}
+	}
+	
+	double zvar;
+	int status; // Of the sampling calls, 0 on success
+	last_checkpoint = completed;
+	if( sample_streams && (fbm_sampler_start_parallel(sampler, producers, consumers, completed, (last_sample - completed), number_of_drifts, lin_drifts, frac_drifts) != 0)){fprintf(stderr, "%s Terminate.\n", fbm_error_message()); exit(2);}
+	for(iter = completed; iter < last_sample; iter += block)
+	{
+		// Generate subgrid and find first passage by adaptive bisections
+		block = MIN(block_length, (last_sample - iter));
+		if(sample_streams){status = fbm_sampler_collect_parallel(sampler, block, first_passage_times, weights);}
+		else if(multiple_drifts){status = fbm_sampler_sample_drifts(sampler, 1, number_of_drifts, lin_drifts, frac_drifts, first_passage_times, weights);}
+		else{status = fbm_sampler_sample_weighted(sampler, 1, first_passage_times, weights);}
+		if(status != 0){fprintf(stderr, "%s Terminate.\n", fbm_error_message()); exit(2);}
 
 		// Convert first passage times into Laplace variables
-		fpt_to_zvar(passage_heights, first_passage_times, hurst);
+		for(k = 0; k < block; k++)
+		{
+			for(d = 0; d < number_of_drifts; d++)
+			{
+				zvar = fpt_to_zvar(passage_heights, first_passage_times[k*number_of_drifts + d], hurst);
+				printf( ((d == 0) ? "%.12f" : "\t%.12f"), zvar);
+				update_statistics(&(stats[d]), first_passage_times[k*number_of_drifts + d], zvar, weights[k]);
+			}
+			if(tilt != 0.0){printf("\t%.12e\n", weights[k]);}else{printf("\n");}
+		}
+
+		// The output is synced before the checkpoint is renamed into place, so everything up to the checkpoint is on disk
+		if( (checkpoint_file != NULL) && ( ((iter + block - last_checkpoint) >= checkpoint_interval) || ((iter + block) == last_sample)) )
+		{
+			last_checkpoint = (iter + block);
+			if( (fflush(stdout) != 0) || ( (output_file != NULL) && (fsync(fileno(stdout)) != 0))){fprintf(stderr, "Cannot write output file '%s' to disk. Terminate.\n", output_file); exit(2);} // Without -o the samples go to a terminal or pipe, which cannot be resumed from
+			write_checkpoint(checkpoint_file, sampler, (iter + block), ftell(stdout), sample_streams, first_sample, number_of_drifts, lin_drifts, frac_drifts, stats);
+		}
 
 	}// End iteration
+	fbm_sampler_stop_parallel(sampler);
+
+	for(d = 0; d < number_of_drifts; d++)
+	{
+		if(multiple_drifts){printf("# Drift mu=%g nu=%g\n", lin_drifts[d], frac_drifts[d]);}
+		print_statistics(&(stats[d]));
+	}
+	if(fbm_sampler_unresolved_midpoints(sampler) > 0){printf("# %ld midpoints had a conditional variance below double precision resolution and were not added to the conditioning set\n", fbm_sampler_unresolved_midpoints(sampler));}
+	if(result_file != NULL){write_result(result_file, &params, iteration, shard, shards, first_sample, last_sample, fbm_sampler_unresolved_midpoints(sampler), sample_streams, number_of_drifts, lin_drifts, frac_drifts, stats);}
 
+	fbm_sampler_destroy(sampler);
+	free(stats);
+	free(first_passage_times);
+	free(weights);
+	free(lin_drifts);
+	free(frac_drifts);
 	return 0;
 }
 
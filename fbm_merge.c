@@ -0,0 +1,126 @@
+/* fracbm-fpt-mc (2019)
+ *
+ * Combines the result files of shards ('fbm --shard i/n --result file') into the result of the whole ensemble.
+ *
+ * Authors: Benjamin Walter (Imperial College) , Kay Wiese (ENS Paris)
+ */
+
+#include "fbm_header.h"
+
+typedef struct shard_result
+{
+	const char* filename;
+	fbm_parameters params;
+	long ensemble_size; // -I of the run
+	int shard, shards; // --shard i/n
+	long first_sample, last_sample; // Covers the samples [first_sample, last_sample)
+	long unresolved_midpoints;
+	int sample_streams;
+	int number_of_drifts;
+	double *lin_drifts, *frac_drifts;
+	fpt_statistics *stats;
+} shard_result;
+
+int compare_first_sample(const void* a, const void* b)
+{
+	long first_a = ((const shard_result*) a)->first_sample;
+	long first_b = ((const shard_result*) b)->first_sample;
+	return ( (first_a > first_b) - (first_a < first_b));
+}
+
+int main(int argc, char *argv[])
+{
+	char *output_file = NULL; // Merged result, can be merged again
+	int partial = 0; // -p: the results may cover only part of the ensemble
+	int i, d, c;
+	opterr = 0;
+	while( (c = getopt(argc, argv, "o:p")) != -1)
+	{
+		switch(c)
+		{
+			case 'o':
+				output_file = optarg;
+				break;
+			case 'p':
+				partial = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: fbm-merge [-p] [-o merged result] result files\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	int number_of_results = (argc - optind);
+	if(number_of_results < 1){fprintf(stderr, "Usage: fbm-merge [-p] [-o merged result] result files\n"); exit(EXIT_FAILURE);}
+
+	shard_result *results;
+	ALLOC(results, number_of_results);
+	for(i = 0; i < number_of_results; i++)
+	{
+		results[i].filename = argv[optind + i];
+		read_result(results[i].filename, &(results[i].params), &(results[i].ensemble_size), &(results[i].shard), &(results[i].shards), &(results[i].first_sample), &(results[i].last_sample), &(results[i].unresolved_midpoints), &(results[i].sample_streams), &(results[i].number_of_drifts), &(results[i].lin_drifts), &(results[i].frac_drifts), &(results[i].stats));
+	}
+
+	// Sums are taken in the order of the samples, so the merge does not depend on the order of the files
+	qsort(results, number_of_results, sizeof(shard_result), compare_first_sample);
+
+	shard_result *first = &(results[0]);
+	for(i = 0; i < number_of_results; i++)
+	{
+		if(!results[i].sample_streams){fprintf(stderr, "'%s' was not drawn with per sample RNG streams (-j or --shard), its samples cannot be placed in the ensemble. Terminate.\n", results[i].filename); exit(EXIT_FAILURE);}
+		if(!compatible_parameters(&(first->params), &(results[i].params))){fprintf(stderr, "'%s' and '%s' were written with different simulation parameters or seeds. Terminate.\n", first->filename, results[i].filename); exit(EXIT_FAILURE);}
+		if(results[i].ensemble_size != first->ensemble_size){fprintf(stderr, "'%s' and '%s' belong to ensembles of different size (%ld and %ld samples). Terminate.\n", first->filename, results[i].filename, first->ensemble_size, results[i].ensemble_size); exit(EXIT_FAILURE);}
+		if( (results[i].first_sample < 0) || (results[i].last_sample > results[i].ensemble_size)){fprintf(stderr, "'%s' covers samples outside its ensemble. Terminate.\n", results[i].filename); exit(EXIT_FAILURE);}
+		if(results[i].number_of_drifts != first->number_of_drifts){fprintf(stderr, "'%s' and '%s' have different drifts. Terminate.\n", first->filename, results[i].filename); exit(EXIT_FAILURE);}
+		for(d = 0; d < first->number_of_drifts; d++)
+		{
+			if( (results[i].lin_drifts[d] != first->lin_drifts[d]) || (results[i].frac_drifts[d] != first->frac_drifts[d])){fprintf(stderr, "'%s' and '%s' have different drifts. Terminate.\n", first->filename, results[i].filename); exit(EXIT_FAILURE);}
+			if(results[i].stats[d].samples != (results[i].last_sample - results[i].first_sample)){fprintf(stderr, "'%s' does not hold all samples of its range (%ld of %ld). Terminate.\n", results[i].filename, results[i].stats[d].samples, (results[i].last_sample - results[i].first_sample)); exit(EXIT_FAILURE);}
+		}
+		if( (i > 0) && (results[i].first_sample != results[i-1].last_sample))
+		{
+			fprintf(stderr, "Samples %ld to %ld of '%s' and %ld to %ld of '%s' %s. Terminate.\n", results[i-1].first_sample, (results[i-1].last_sample - 1), results[i-1].filename, results[i].first_sample, (results[i].last_sample - 1), results[i].filename, ( (results[i].first_sample > results[i-1].last_sample) ? "leave a gap" : "overlap"));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Merge
+	int number_of_drifts = first->number_of_drifts;
+	long unresolved_midpoints = 0;
+	fpt_statistics *stats;
+	ALLOC(stats, number_of_drifts);
+	for(d = 0; d < number_of_drifts; d++){initialise_statistics(&(stats[d]));}
+	for(i = 0; i < number_of_results; i++)
+	{
+		for(d = 0; d < number_of_drifts; d++){add_statistics(&(stats[d]), &(results[i].stats[d]));}
+		unresolved_midpoints += results[i].unresolved_midpoints;
+	}
+	long first_sample = first->first_sample;
+	long last_sample = results[number_of_results - 1].last_sample;
+	long ensemble_size = first->ensemble_size;
+	int complete = ( (first_sample == 0) && (last_sample == ensemble_size));
+	if(!complete)
+	{
+		// Without -p, a missing first or last shard is an error rather than a smaller ensemble
+		fprintf(stderr, "%sThe results cover samples %ld to %ld of the ensemble of %ld samples (0 to %ld).%s\n", (partial ? "Warning: " : ""), first_sample, (last_sample - 1), ensemble_size, (ensemble_size - 1), (partial ? "" : " Use -p to merge part of an ensemble. Terminate."));
+		if(!partial) exit(EXIT_FAILURE);
+	}
+
+	printf("# FRACBM-FPT-MC (2019), merged %i results\n# Samples %ld to %ld of %ld%s, RNG Seed %i\n", number_of_results, first_sample, (last_sample - 1), ensemble_size, (complete ? "" : " (partial)"), first->params.seed);
+	for(d = 0; d < number_of_drifts; d++)
+	{
+		if(number_of_drifts > 1){printf("# Drift mu=%g nu=%g\n", first->lin_drifts[d], first->frac_drifts[d]);}
+		print_statistics(&(stats[d]));
+	}
+	if(unresolved_midpoints > 0){printf("# %ld midpoints had a conditional variance below double precision resolution and were not added to the conditioning set\n", unresolved_midpoints);}
+	if(output_file != NULL){write_result(output_file, &(first->params), ensemble_size, (complete ? 0 : -1), (complete ? 1 : 0), first_sample, last_sample, unresolved_midpoints, 1, number_of_drifts, first->lin_drifts, first->frac_drifts, stats);}
+
+	for(i = 0; i < number_of_results; i++)
+	{
+		free(results[i].lin_drifts);
+		free(results[i].frac_drifts);
+		free(results[i].stats);
+	}
+	free(results);
+	free(stats);
+	return 0;
+}
@@ -0,0 +1,590 @@
+/* fracbm-fpt-mc (2019)
+ *
+ * Authors: Benjamin Walter (Imperial College) , Kay Wiese (ENS Paris)
+ *
+ * Pipelined sampling on several threads. Producer threads draw Davies-Harte subgrids into a bounded queue, consumer threads take them from there and run the bisection.
+ * The cost of a subgrid is fixed, the cost of the bisection ranges from nothing to thousands of midpoints; since every consumer takes the next path as soon as it is free, no thread waits for a slow sample of another.
+ * The threads run from fbm_sampler_start_parallel to fbm_sampler_stop_parallel, the caller collects the finished samples in order in between. Finished samples wait in a ring of PIPELINE_WINDOW slots until they are collected, so a slow sample holds back only the output, and the producers only once it is a whole window behind.
+ * The shared queue is the only load balancing, with one queue there is nothing to steal, and the thread counts are fixed. A thread that finds its queue empty (or the window full) spins briefly and then blocks until it is woken.
+ */
+
+
+#include "fbm_header.h"
+
+/* Per sample streams. Sample k reads the counter-based generator Philox4x32-10 (Salmon, Moraes, Dror, Shaw, SC'11) under the key (seed, 2k) for its subgrid and (seed, 2k+1) for its midpoints; the i-th block of four numbers of a stream is the 10-round Philox bijection of the counter (i, 0, domain) under the key.
+ * No two streams, of the same or of different seeds, ever evaluate the generator at the same key and counter, so their numbers are disjoint by construction, not merely unlikely to overlap. */
+void philox4x32_10(const uint32_t* counter, const uint32_t* key, uint32_t* output)
+{
+	uint32_t x0 = counter[0], x1 = counter[1], x2 = counter[2], x3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+	uint64_t p0, p1;
+	int round;
+	for(round = 0; round < 10; round++)
+	{
+		p0 = (((uint64_t) 0xD2511F53u) * x0);
+		p1 = (((uint64_t) 0xCD9E8D57u) * x2);
+		x0 = (((uint32_t) (p1 >> 32)) ^ x1 ^ k0);
+		x1 = ((uint32_t) p1);
+		x2 = (((uint32_t) (p0 >> 32)) ^ x3 ^ k1);
+		x3 = ((uint32_t) p0);
+		k0 += 0x9E3779B9u; // Weyl sequence of the round keys
+		k1 += 0xBB67AE85u;
+	}
+	output[0] = x0;
+	output[1] = x1;
+	output[2] = x2;
+	output[3] = x3;
+}
+
+void stream_rng_set(void* vstate, unsigned long key)
+{
+	// gsl_rng_set: the key as one number (set_sample_stream is used by the samplers)
+	stream_rng_state* state = vstate;
+	memset(state, 0, sizeof(stream_rng_state));
+	state->key[0] = ((uint32_t) key);
+	state->key[1] = ((uint32_t) ((key >> 16) >> 16));
+	state->used = 4;
+}
+
+unsigned long stream_rng_get(void* vstate)
+{
+	stream_rng_state* state = vstate;
+	if(state->used == 4)
+	{
+		philox4x32_10(state->counter, state->key, state->block);
+		if(++(state->counter[0]) == 0){state->counter[1]++;}
+		state->used = 0;
+	}
+	return state->block[(state->used)++];
+}
+
+double stream_rng_get_double(void* vstate)
+{
+	return (stream_rng_get(vstate) / 4294967296.0);
+}
+
+static const gsl_rng_type stream_rng = {"philox4x32-10", 0xffffffffUL, 0, sizeof(stream_rng_state), &stream_rng_set, &stream_rng_get, &stream_rng_get_double};
+const gsl_rng_type* stream_rng_type = &stream_rng;
+
+void set_sample_stream(gsl_rng* rng, int seed, unsigned long stream, uint32_t domain)
+{
+	// rng has to be of stream_rng_type. Starts the stream at its first number.
+	stream_rng_state* state = gsl_rng_state(rng);
+	memset(state, 0, sizeof(stream_rng_state));
+	state->key[0] = ((uint32_t) seed);
+	state->key[1] = ((uint32_t) stream);
+	state->counter[3] = domain;
+	state->used = 4;
+}
+
+void initialise_queue(fbm_queue* q, long capacity)
+{
+	long i;
+	q->capacity = capacity;
+	ALLOC(q->cells, capacity);
+	for(i = 0; i < capacity; i++)
+	{
+		atomic_init(&(q->cells[i].sequence), i);
+		q->cells[i].path = NULL;
+	}
+	atomic_init(&(q->tail), 0);
+	atomic_init(&(q->head), 0);
+	atomic_init(&(q->waiting), 0);
+	pthread_mutex_init(&(q->lock), NULL);
+	pthread_cond_init(&(q->pushed), NULL);
+}
+
+void free_queue(fbm_queue* q)
+{
+	if(q->cells == NULL) return; // Never initialised
+	free(q->cells);
+	pthread_mutex_destroy(&(q->lock));
+	pthread_cond_destroy(&(q->pushed));
+}
+
+int queue_push(fbm_queue* q, fbm_path* path)
+{
+	// Returns 0 if the queue is full
+	fbm_queue_cell* cell;
+	long sequence;
+	long position = atomic_load_explicit(&(q->tail), memory_order_relaxed);
+	for(;;)
+	{
+		cell = &(q->cells[position & (q->capacity - 1)]);
+		sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+		if(sequence == position)
+		{
+			if(atomic_compare_exchange_weak_explicit(&(q->tail), &position, (position + 1), memory_order_relaxed, memory_order_relaxed)) break;
+		}
+		else if(sequence < position){return 0;}
+		else{position = atomic_load_explicit(&(q->tail), memory_order_relaxed);}
+	}
+	cell->path = path;
+	atomic_store_explicit(&(cell->sequence), (position + 1), memory_order_release);
+	return 1;
+}
+
+int queue_pop(fbm_queue* q, fbm_path** path)
+{
+	// Returns 0 if the queue is empty
+	fbm_queue_cell* cell;
+	long sequence;
+	long position = atomic_load_explicit(&(q->head), memory_order_relaxed);
+	for(;;)
+	{
+		cell = &(q->cells[position & (q->capacity - 1)]);
+		sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+		if(sequence == (position + 1))
+		{
+			if(atomic_compare_exchange_weak_explicit(&(q->head), &position, (position + 1), memory_order_relaxed, memory_order_relaxed)) break;
+		}
+		else if(sequence < (position + 1)){return 0;}
+		else{position = atomic_load_explicit(&(q->head), memory_order_relaxed);}
+	}
+	*path = cell->path;
+	atomic_store_explicit(&(cell->sequence), (position + q->capacity), memory_order_release);
+	return 1;
+}
+
+void queue_wake(fbm_queue* q)
+{
+	// Wakes the threads blocked on q, after a push or when the pipeline stops. The lock is only taken if a thread has announced itself.
+	atomic_thread_fence(memory_order_seq_cst); // The push (or stop) before 'waiting' is read, see queue_wait_pop
+	if(atomic_load(&(q->waiting)) == 0) return;
+	pthread_mutex_lock(&(q->lock));
+	pthread_cond_broadcast(&(q->pushed));
+	pthread_mutex_unlock(&(q->lock));
+}
+
+int queue_wait_pop(fbm_queue* q, fbm_path** path, atomic_int* stop)
+{
+	// Pops a path, waiting while the queue is empty: a short spin, then blocked until queue_wake. Returns 0 if *stop is set and the queue is empty.
+	int i, popped;
+	for(i = 0; i < PIPELINE_SPIN; i++)
+	{
+		if(queue_pop(q, path)) return 1;
+		if(atomic_load(stop)) return 0;
+	}
+	pthread_mutex_lock(&(q->lock));
+	atomic_fetch_add(&(q->waiting), 1);
+	atomic_thread_fence(memory_order_seq_cst); // Announced before the last check: either it sees the push, or the pusher sees 'waiting' and waits for the lock
+	while( !(popped = queue_pop(q, path)) && !atomic_load(stop)){pthread_cond_wait(&(q->pushed), &(q->lock));}
+	atomic_fetch_sub(&(q->waiting), 1);
+	pthread_mutex_unlock(&(q->lock));
+	return popped;
+}
+
+void prepare_producer(fbm_worker* w, fbm_sampler* s)
+{
+	// Only the buffers of the sampler's precision. The output of the FFT is allocated last, it marks a prepared producer.
+#ifdef FBM_SINGLE_SUBGRID
+	if(s->params.single_precision)
+	{
+		if(w->fracGNf != NULL) return;
+		if(w->rndWf == NULL){FFTF_ALLOC(w->rndWf, 2*(s->N));}
+		FFTF_ALLOC(w->fracGNf, 2*(s->N));
+		return;
+	}
+#endif
+	if(w->fracGN != NULL) return;
+	if(w->rndW == NULL){FFT_ALLOC(w->rndW, 2*(s->N));}
+	if(w->randomComplexGaussian == NULL){ALLOC(w->randomComplexGaussian, s->N);}
+	FFT_ALLOC(w->fracGN, 2*(s->N));
+}
+
+void prepare_consumer(fbm_worker* w, fbm_sampler* s, int number_of_drifts)
+{
+	// QI is set up last, it marks a prepared consumer
+	if(w->QI == NULL)
+	{
+		if(w->fracbm == NULL){ALLOC(w->fracbm, (s->N + 1));}
+		if(w->gamma_N_vec == NULL){ALLOC(w->gamma_N_vec, pow(2, (s->params.g + s->params.max_generation)));}
+		if(w->g_vec == NULL){ALLOC(w->g_vec, pow(2, (s->params.g + s->params.max_generation)));}
+		initialise_QI(&(w->QI), 2*(s->N), s->params.hurst);
+	}
+	if( (number_of_drifts > 1) && (w->QI->midpoint_catalogue == NULL)){enable_midpoint_catalogue(w->QI, (s->subgrid_levels + s->bisection_levels));}
+}
+
+void produce_path(fbm_worker* w, fbm_path* path, long k)
+{
+	// Subgrid of sample k, which only depends on the seed and k
+	fbm_pipeline* p = w->pipeline;
+	fbm_sampler* s = p->sampler;
+	fbm_parameters* params = &(s->params);
+
+	r = w->r;
+	set_sample_stream(r, params->seed, 2*((unsigned long) (p->first_index + k)), STREAM_DOMAIN_SAMPLES);
+	draw_subgrid_noise(s, w->randomComplexGaussian, w->rndW, w->fracGN, w->rndWf, w->fracGNf); // The plans of the sampler, on this thread's buffers
+
+	path->index = k;
+	path->weight = ( (params->tilt != 0.0) ? likelihood_ratio(w->fracGN, w->fracGNf, s->tilt_direction, s->tilt_norm, params->tilt, s->N) : 1.0);
+	xfracbm = path->xfracbm;
+	integrate_noise_drifts(w->fracGN, w->fracGNf, params->tilt, p->number_of_drifts, p->lin_drifts, p->frac_drifts, s->N, params->hurst, path->last_point_index, &(path->max_last_point_index), params->passage_height);
+}
+
+void activate_worker(fbm_worker* w)
+{
+	// Point this thread's working variables at the conditioning workspace of w
+	QI = w->QI;
+	r = w->r;
+	gamma_N_vec = w->gamma_N_vec;
+	g_vec = w->g_vec;
+	max_generation = w->pipeline->sampler->bisection_levels;
+}
+
+void consume_path(fbm_worker* w, fbm_path* path)
+{
+	// As fbm_sampler_sample_drifts, with the midpoints of the sample from their own stream. The results go to the slot of the sample in the result ring. activate_worker has to be called before.
+	fbm_pipeline* p = w->pipeline;
+	fbm_sampler* s = p->sampler;
+	fbm_parameters* params = &(s->params);
+	long k = path->index;
+	long slot = (k & (p->window - 1));
+	double* first_passage_times = &(p->first_passage_times[slot*(p->number_of_drifts)]);
+	long unresolved_midpoints = w->QI->unresolved_midpoints;
+	int d;
+
+	r = w->r;
+	set_sample_stream(r, params->seed, (2*((unsigned long) (p->first_index + k)) + 1), STREAM_DOMAIN_SAMPLES);
+	xfracbm = path->xfracbm;
+	copy_QI(s->QCholeskyFactor, path->max_last_point_index, (1/((double) s->N)));
+	for(d = 0; d < p->number_of_drifts; d++)
+	{
+		lin_drift = p->lin_drifts[d];
+		frac_drift = p->frac_drifts[d];
+		add_drift(w->fracbm, lin_drift, frac_drift, s->N, params->hurst, path->last_point_index[d]);
+		first_passage_times[d] = 0.0;
+		find_fpt(w->fracbm, &(first_passage_times[d]), params->passage_height, s->N, params->epsilon, params->hurst, path->last_point_index[d]);
+	}
+	p->weights[slot] = path->weight;
+	p->unresolved_midpoints[slot] = (w->QI->unresolved_midpoints - unresolved_midpoints); // Counted per sample, so that the sampler's count covers exactly the samples collected
+	atomic_store_explicit(&(p->finished[slot]), (k + 1), memory_order_release);
+}
+
+void pipeline_wake(fbm_pipeline* p)
+{
+	// Wakes the threads blocked in pipeline_wait_window and the caller blocked in fbm_sampler_collect_parallel, as queue_wake
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load(&(p->waiting)) == 0) return;
+	pthread_mutex_lock(&(p->lock));
+	pthread_cond_broadcast(&(p->progress));
+	pthread_mutex_unlock(&(p->lock));
+}
+
+int pipeline_wait_window(fbm_pipeline* p, long k)
+{
+	// Waits until sample k fits into the result ring, i.e. until the sample window places before it has been collected. Returns 0 if the pipeline stops first.
+	int i, fits;
+	for(i = 0; i < PIPELINE_SPIN; i++)
+	{
+		if(k < (atomic_load(&(p->collected)) + p->window)) return 1;
+		if(atomic_load(&(p->stop))) return 0;
+	}
+	pthread_mutex_lock(&(p->lock));
+	atomic_fetch_add(&(p->waiting), 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while( !(fits = (k < (atomic_load(&(p->collected)) + p->window))) && !atomic_load(&(p->stop))){pthread_cond_wait(&(p->progress), &(p->lock));}
+	atomic_fetch_sub(&(p->waiting), 1);
+	pthread_mutex_unlock(&(p->lock));
+	return fits;
+}
+
+int pipeline_wait_result(fbm_pipeline* p, long k)
+{
+	// Waits until sample k is in its slot. Returns 0 if the pipeline fails first.
+	long slot = (k & (p->window - 1));
+	int i, finished;
+	for(i = 0; i < PIPELINE_SPIN; i++)
+	{
+		if(atomic_load_explicit(&(p->finished[slot]), memory_order_acquire) == (k + 1)) return 1;
+		if(atomic_load(&(p->failed))) return 0;
+	}
+	pthread_mutex_lock(&(p->lock));
+	atomic_fetch_add(&(p->waiting), 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while( !(finished = (atomic_load_explicit(&(p->finished[slot]), memory_order_acquire) == (k + 1))) && !atomic_load(&(p->failed))){pthread_cond_wait(&(p->progress), &(p->lock));}
+	atomic_fetch_sub(&(p->waiting), 1);
+	pthread_mutex_unlock(&(p->lock));
+	return finished;
+}
+
+void pipeline_fail(fbm_pipeline* p)
+{
+	// Keeps the message of the first failure (of this thread's error_message) for the caller and releases all threads
+	if(atomic_exchange(&(p->failed), 1) == 0){memcpy(p->error_message, error_message, ERROR_MESSAGE_LENGTH);}
+	atomic_store(&(p->stop), 1);
+	queue_wake(&(p->full_paths));
+	queue_wake(&(p->free_paths));
+	pipeline_wake(p);
+}
+
+void* producer_thread(void* argument)
+{
+	fbm_worker* w = argument;
+	fbm_pipeline* p = w->pipeline;
+	fbm_path* path;
+	long k;
+	jmp_buf handler;
+	if(setjmp(handler) != 0)
+	{
+		error_handler = NULL;
+		pipeline_fail(p);
+		return NULL;
+	}
+	error_handler = &handler; // Errors stop the pipeline instead of the program
+
+	while( !atomic_load(&(p->stop)) && ( (k = atomic_fetch_add(&(p->next_index), 1)) < p->n))
+	{
+		if(!pipeline_wait_window(p, k)) break;
+		if(!queue_wait_pop(&(p->free_paths), &path, &(p->stop))) break;
+		produce_path(w, path, k);
+		queue_push(&(p->full_paths), path); // Cannot fail, the queue has room for all paths
+		queue_wake(&(p->full_paths));
+	}
+	error_handler = NULL;
+	return NULL;
+}
+
+void* consumer_thread(void* argument)
+{
+	fbm_worker* w = argument;
+	fbm_pipeline* p = w->pipeline;
+	fbm_path* path;
+	jmp_buf handler;
+	if(setjmp(handler) != 0)
+	{
+		error_handler = NULL;
+		pipeline_fail(p);
+		return NULL;
+	}
+	error_handler = &handler;
+
+	activate_worker(w);
+	while( !atomic_load(&(p->failed)) && queue_wait_pop(&(p->full_paths), &path, &(p->stop)))
+	{
+		consume_path(w, path);
+		queue_push(&(p->free_paths), path);
+		queue_wake(&(p->free_paths));
+		pipeline_wake(p); // The caller may wait for this sample
+		if( (atomic_fetch_add(&(p->completed), 1) + 1) == p->n)
+		{
+			// Last sample: release the consumers waiting for more
+			atomic_store(&(p->stop), 1);
+			queue_wake(&(p->full_paths));
+		}
+	}
+	error_handler = NULL;
+	return NULL;
+}
+
+void free_worker(fbm_worker* w)
+{
+	fftw_free(w->rndW);
+	fftw_free(w->fracGN);
+#ifdef FBM_SINGLE_SUBGRID
+	fftwf_free(w->rndWf);
+	fftwf_free(w->fracGNf);
+#endif
+	free(w->randomComplexGaussian);
+	free(w->fracbm);
+	free(w->gamma_N_vec);
+	free(w->g_vec);
+	if(w->QI != NULL){free_QI(&(w->QI));}
+	gsl_rng_free(w->r);
+}
+
+void free_pipeline(fbm_pipeline* p)
+{
+	// Also for a pipeline whose set up failed half way, it is zeroed before. Its threads have to be joined.
+	long i;
+	if(p->paths != NULL)
+	{
+		for(i = 0; i < p->number_of_paths; i++)
+		{
+			free(p->paths[i].xfracbm);
+			free(p->paths[i].last_point_index);
+		}
+	}
+	free(p->paths);
+	free_queue(&(p->full_paths));
+	free_queue(&(p->free_paths));
+	free(p->first_passage_times);
+	free(p->weights);
+	free(p->unresolved_midpoints);
+	free(p->finished);
+	free(p->threads);
+	if(p->lock_initialised)
+	{
+		pthread_mutex_destroy(&(p->lock));
+		pthread_cond_destroy(&(p->progress));
+	}
+	free(p);
+}
+
+int fbm_sampler_start_parallel(fbm_sampler* s, int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts)
+{
+	int i, threads = (producers + consumers);
+	int workers = MAX(threads, 1);
+	long k;
+	fbm_pipeline* volatile p = NULL; // Read after longjmp
+	jmp_buf handler;
+	jmp_buf* caller_handler = error_handler;
+	if(setjmp(handler) != 0)
+	{
+		// Nothing has been started yet, s->pipeline is only set once the set up is complete
+		error_handler = caller_handler;
+		if(p != NULL){free_pipeline(p);}
+		return -1;
+	}
+	error_handler = &handler;
+
+	if(s->pipeline != NULL){fbm_error(1, "The pipeline of this sampler is already running.");}
+	if( (threads > 0) && ( (producers < 1) || (consumers < 1))){fbm_error(1, "The pipeline needs at least one producer and one consumer thread.");}
+	if( (n < 0) || (number_of_drifts < 1)){fbm_error(1, "The pipeline needs n >= 0 samples and at least one drift.");}
+	if( (first_index < 0) || ((first_index + n) > 2147483648L)){fbm_error(1, "Sample indices of the pipeline are limited to [0, 2^31).");} // Two RNG streams per sample
+
+	// Thread buffers are kept for the next pipeline
+	if(workers > s->number_of_workers)
+	{
+		i = s->number_of_workers;
+		s->number_of_workers = 0; // Until the new workers are set up, in case the allocation fails
+		REALLOC(s->workers, workers);
+		for(; i < workers; i++)
+		{
+			memset(&(s->workers[i]), 0, sizeof(fbm_worker));
+			s->workers[i].r = gsl_rng_alloc(stream_rng_type);
+		}
+		s->number_of_workers = workers;
+	}
+	if(threads == 0)
+	{
+		// The same samples on the calling thread, worker 0 does both stages in fbm_sampler_collect_parallel
+		prepare_producer(&(s->workers[0]), s);
+		prepare_consumer(&(s->workers[0]), s, number_of_drifts);
+	}
+	for(i = 0; i < producers; i++){prepare_producer(&(s->workers[i]), s);}
+	for(i = producers; i < threads; i++){prepare_consumer(&(s->workers[i]), s, number_of_drifts);}
+
+	p = calloc(1, sizeof(fbm_pipeline));
+	if(p == NULL){fbm_error(2, "Allocation of 'p' failed.");}
+	p->sampler = s;
+	p->first_index = first_index;
+	p->n = n;
+	p->number_of_drifts = number_of_drifts;
+	p->lin_drifts = lin_drifts;
+	p->frac_drifts = frac_drifts;
+	p->producers = producers;
+	p->consumers = consumers;
+
+	// Paths in flight. The queues have room for all of them, so a push never fails.
+	p->number_of_paths = 1;
+	while(p->number_of_paths < (PIPELINE_PATHS_PER_THREAD * workers)){p->number_of_paths *= 2;}
+	p->paths = calloc(p->number_of_paths, sizeof(fbm_path));
+	if(p->paths == NULL){fbm_error(2, "Allocation of 'p->paths' failed.");}
+	initialise_queue(&(p->full_paths), p->number_of_paths);
+	initialise_queue(&(p->free_paths), p->number_of_paths);
+	for(i = 0; i < p->number_of_paths; i++)
+	{
+		ALLOC(p->paths[i].xfracbm, (s->N + 1));
+		ALLOC(p->paths[i].last_point_index, number_of_drifts);
+		queue_push(&(p->free_paths), &(p->paths[i]));
+	}
+
+	// Result ring
+	p->window = PIPELINE_WINDOW;
+	ALLOC(p->first_passage_times, (p->window * number_of_drifts));
+	ALLOC(p->weights, p->window);
+	ALLOC(p->unresolved_midpoints, p->window);
+	ALLOC(p->finished, p->window);
+	for(k = 0; k < p->window; k++){atomic_init(&(p->finished[k]), 0);}
+	ALLOC(p->threads, workers);
+
+	atomic_init(&(p->next_index), 0);
+	atomic_init(&(p->completed), 0);
+	atomic_init(&(p->collected), 0);
+	atomic_init(&(p->stop), 0);
+	atomic_init(&(p->failed), 0);
+	atomic_init(&(p->waiting), 0);
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->progress), NULL);
+	p->lock_initialised = 1;
+	for(i = 0; i < workers; i++){s->workers[i].pipeline = p;}
+	s->pipeline = p;
+	error_handler = caller_handler;
+
+	// The threads run until all n samples are done, or until fbm_sampler_stop_parallel
+	if(n == 0) return 0;
+	for(p->started = 0; p->started < threads; p->started++)
+	{
+		if(pthread_create(&(p->threads[p->started]), NULL, ((p->started < producers) ? producer_thread : consumer_thread), &(s->workers[p->started])) != 0)
+		{
+			set_error_message("Cannot start pipeline thread.");
+			fbm_sampler_stop_parallel(s);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int fbm_sampler_collect_parallel(fbm_sampler* s, long n, double* first_passage_times, double* weights)
+{
+	CATCH_ERRORS(-1)
+	fbm_pipeline* p = s->pipeline;
+	long i, k, slot;
+	int d;
+	if(p == NULL){fbm_error(1, "The pipeline of this sampler is not running.");}
+	if( (n < 0) || ((atomic_load(&(p->collected)) + n) > p->n)){fbm_error(1, "Only %ld samples of the pipeline are left to collect.", (p->n - atomic_load(&(p->collected))));}
+
+	if(p->started == 0){activate_worker(&(s->workers[0]));}
+	for(i = 0; i < n; i++)
+	{
+		k = atomic_load(&(p->collected));
+		slot = (k & (p->window - 1));
+		if(p->started == 0)
+		{
+			// No threads: draw the sample here
+			produce_path(&(s->workers[0]), &(p->paths[0]), k);
+			consume_path(&(s->workers[0]), &(p->paths[0]));
+		}
+		else if(!pipeline_wait_result(p, k))
+		{
+			set_error_message("%s", p->error_message); // Reported on the calling thread
+			END_CATCH_ERRORS
+			return -1;
+		}
+		for(d = 0; d < p->number_of_drifts; d++){first_passage_times[i*(p->number_of_drifts) + d] = p->first_passage_times[slot*(p->number_of_drifts) + d];}
+		if(weights != NULL){weights[i] = p->weights[slot];}
+		s->QI->unresolved_midpoints += p->unresolved_midpoints[slot];
+		atomic_store(&(p->collected), (k + 1)); // Frees the slot for sample k + window
+		if(p->started > 0){pipeline_wake(p);}
+	}
+	if(p->started == 0){activate_sampler(s);}
+	END_CATCH_ERRORS
+	return 0;
+}
+
+void fbm_sampler_stop_parallel(fbm_sampler* s)
+{
+	// Stops the threads, also before all samples are done, and frees the pipeline. The thread buffers stay with the sampler.
+	fbm_pipeline* p = s->pipeline;
+	int i;
+	if(p == NULL) return;
+	atomic_store(&(p->stop), 1);
+	queue_wake(&(p->full_paths));
+	queue_wake(&(p->free_paths));
+	pipeline_wake(p);
+	for(i = 0; i < p->started; i++){pthread_join(p->threads[i], NULL);}
+	if(p->started == 0){activate_sampler(s);}
+	free_pipeline(p);
+	s->pipeline = NULL;
+}
+
+int fbm_sampler_sample_parallel(fbm_sampler* s, int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* first_passage_times, double* weights)
+{
+	// One range: start the pipeline, collect all of it and stop it
+	int status;
+	if(fbm_sampler_start_parallel(s, producers, consumers, first_index, n, number_of_drifts, lin_drifts, frac_drifts) != 0) return -1;
+	status = fbm_sampler_collect_parallel(s, n, first_passage_times, weights);
+	fbm_sampler_stop_parallel(s);
+	return status;
+}
@@ -0,0 +1,431 @@
+/* fracbm-fpt-mc (2019)
+ *
+ * Authors: Benjamin Walter (Imperial College) , Kay Wiese (ENS Paris)
+ *
+ * Sampler object behind the library interface in fracbm.h.
+ */
+
+
+#include "fbm_header.h"
+
+void fbm_default_parameters(fbm_parameters* params)
+{
+	params->hurst = 0.5;
+	params->g = 8;
+	params->max_generation = 8;
+	params->epsilon = 1e-9;
+	params->lin_drift = 0.0;
+	params->frac_drift = 0.0;
+	params->passage_height = 0.1;
+	params->seed = -1;
+	params->coarse_levels = 0;
+	params->tilt = 0.0;
+	params->single_precision = 0;
+}
+
+fbm_sampler* fbm_sampler_create(const fbm_parameters* params)
+{
+	if( (params == NULL) || (params->hurst <= 0.0) || (params->hurst >= 1.0) || (params->g < 1) || (params->max_generation < 0) || (params->coarse_levels < 0) || (params->coarse_levels >= params->g) || (params->epsilon <= 0.0) || (params->epsilon >= 0.5) || (params->passage_height <= 0.0)){set_error_message("Simulation parameters out of range."); return NULL;}
+#ifndef FBM_SINGLE_SUBGRID
+	if(params->single_precision){set_error_message("Single precision subgrid needs a build with single precision FFTW (SINGLE=1)."); return NULL;}
+#endif
+
+	// Zeroed, so that fbm_sampler_destroy can free a sampler whose set up failed half way
+	fbm_sampler* s = calloc(1, sizeof(fbm_sampler));
+	if(s == NULL){set_error_message("Allocation of 's' failed."); return NULL;}
+	jmp_buf handler;
+	jmp_buf* caller_handler = error_handler;
+	if(setjmp(handler) != 0)
+	{
+		error_handler = caller_handler;
+		fbm_sampler_destroy(s);
+		return NULL;
+	}
+	error_handler = &handler;
+
+	s->params = (*params);
+	s->subgrid_levels = (params->g - params->coarse_levels);
+	s->bisection_levels = (params->max_generation + params->coarse_levels); // Same effective system size 2^(g+G)
+	long N = ((long) pow(2, s->subgrid_levels));
+	s->N = N;
+	double hurst = params->hurst;
+
+	// Initialise observables
+	initialise(&(s->correlation), &(s->circulant_eigenvalues), &(s->rndW), &(s->fracGN), &(s->correlation_exponents), &(s->randomComplexGaussian), N, &(s->r), &(s->T), &(s->params.seed), params->single_precision);
+	initialise_trajectory(&(s->fracbm), &(s->xfracbm), N);
+	initialise_correlation_cholesky_factor(&(s->QCholeskyFactor), N);
+
+	// Conditioning workspace
+	ALLOC(s->gamma_N_vec, pow(2, (params->g + params->max_generation))); // Maximal number of points possible
+	ALLOC(s->g_vec, pow(2, (params->g + params->max_generation)));
+	initialise_QI(&(s->QI), 2*N, hurst);
+
+	// Initialise FFT plans
+	s->p1 = fftw_plan_dft_1d(2*N , s->correlation, s->circulant_eigenvalues, FFTW_FORWARD, FFTW_ESTIMATE);
+	if(!params->single_precision){s->p2 = fftw_plan_dft_1d(2*N, s->rndW, s->fracGN, FFTW_BACKWARD, FFTW_ESTIMATE);}
+
+	// Write correlation of noise
+	write_correlation_exponents(s->correlation_exponents, N, (1/((double) N)), hurst);
+	write_correlation(s->correlation, s->correlation_exponents, N);
+
+	// Write Cholesky factor of correlation matrix of FBM
+	write_correlation_cholesky_factor(s->QCholeskyFactor, N, hurst);
+
+	// FFT into circulant eigenvalues
+	fftw_execute(s->p1);
+
+	// Single precision subgrid, instead of the double precision buffers
+	s->rndWf = NULL;
+	s->fracGNf = NULL;
+	s->noise_amplitudes = NULL;
+#ifdef FBM_SINGLE_SUBGRID
+	if(params->single_precision)
+	{
+		FFTF_ALLOC(s->rndWf, 2*N);
+		FFTF_ALLOC(s->fracGNf, 2*N);
+		ALLOC(s->noise_amplitudes, (N + 1));
+		write_noise_amplitudes(s->noise_amplitudes, s->circulant_eigenvalues, N);
+		s->p2f = fftwf_plan_dft_1d(2*N, s->rndWf, s->fracGNf, FFTW_BACKWARD, FFTW_ESTIMATE);
+	}
+#endif
+
+	// Several drifts
+	s->drift_last_point_index = NULL;
+	s->drift_workspace_length = 0;
+
+	// Pipeline threads are set up by the first call of fbm_sampler_start_parallel
+	s->workers = NULL;
+	s->number_of_workers = 0;
+	s->pipeline = NULL;
+
+	// Importance sampling
+	s->tilt_direction = NULL;
+	s->tilt_norm = 0.0;
+	if(params->tilt != 0.0){write_tilt_direction(&(s->tilt_direction), &(s->tilt_norm), s->QCholeskyFactor, N);}
+
+	error_handler = caller_handler;
+	return s;
+}
+
+void activate_sampler(fbm_sampler* s)
+{
+	// Point the global working variables at this sampler
+	QI = s->QI;
+	r = s->r;
+	gamma_N_vec = s->gamma_N_vec;
+	g_vec = s->g_vec;
+	xfracbm = s->xfracbm;
+	lin_drift = s->params.lin_drift;
+	frac_drift = s->params.frac_drift;
+	max_generation = s->bisection_levels;
+}
+
+void draw_subgrid_noise(fbm_sampler* s, complex_z* randomComplexGaussian, fftw_complex* rndW, fftw_complex* fracGN, fftwf_complex* rndWf, fftwf_complex* fracGNf)
+{
+	// Fractional Gaussian noise of one subgrid, with the plans of s on the buffers given. In single precision it is generated, scaled and transformed in float into fracGNf, and integrate_noise reads it from there; the double buffers are not used (and may be NULL).
+#ifdef FBM_SINGLE_SUBGRID
+	if(s->params.single_precision)
+	{
+		generate_random_vector_single(rndWf, s->noise_amplitudes, s->N, 1.0);
+		fftwf_execute_dft(s->p2f, rndWf, fracGNf);
+		return;
+	}
+#endif
+	generate_random_vector(randomComplexGaussian, rndW, s->circulant_eigenvalues, s->N, 1.0);
+	fftw_execute_dft(s->p2, rndW, fracGN);
+}
+
+double fbm_sampler_single_precision_deviation(fbm_sampler* s, int paths, double* critical_strip)
+{
+	CATCH_ERRORS(-1.0)
+	// Same formula as in find_fpt, on the subgrid
+	*critical_strip = (erfcinv(2*s->params.epsilon)*(sqrt( ( (4.0/pow(2.0,2*s->params.hurst)) - 1)))*pow((1/((double) s->N)), s->params.hurst));
+#ifdef FBM_SINGLE_SUBGRID
+	int k;
+	long i, N = s->N;
+	double x_double, x_single, deviation = 0.0;
+	// Buffers of both precisions of its own, a sampler only holds those of its precision
+	fftw_complex *rndW, *fracGN;
+	fftwf_complex *rndWf, *fracGNf;
+	complex_z *randomComplexGaussian;
+	float *amplitudes;
+	FFT_ALLOC(rndW, 2*N);
+	FFT_ALLOC(fracGN, 2*N);
+	FFTF_ALLOC(rndWf, 2*N);
+	FFTF_ALLOC(fracGNf, 2*N);
+	ALLOC(randomComplexGaussian, N);
+	ALLOC(amplitudes, (N + 1));
+	write_noise_amplitudes(amplitudes, s->circulant_eigenvalues, N);
+	fftw_plan p2 = fftw_plan_dft_1d(2*N, rndW, fracGN, FFTW_BACKWARD, FFTW_ESTIMATE);
+	fftwf_plan p2f = fftwf_plan_dft_1d(2*N, rndWf, fracGNf, FFTW_BACKWARD, FFTW_ESTIMATE);
+	gsl_rng* sampling_rng = r;
+	r = gsl_rng_alloc(stream_rng_type); // Test paths do not take numbers from the sampler's stream, nor from those of the samples
+
+	for(k = 0; k < paths; k++)
+	{
+		// Test path k in both precisions, from the same Gaussian numbers
+		set_sample_stream(r, s->params.seed, ((unsigned long) k), STREAM_DOMAIN_TESTS);
+		generate_random_vector(randomComplexGaussian, rndW, s->circulant_eigenvalues, N, 1.0);
+		set_sample_stream(r, s->params.seed, ((unsigned long) k), STREAM_DOMAIN_TESTS);
+		generate_random_vector_single(rndWf, amplitudes, N, 1.0);
+		fftw_execute(p2);
+		fftwf_execute(p2f);
+		x_double = 0.0;
+		x_single = 0.0;
+		for(i = 0; i < N; i++)
+		{
+			x_double += fracGN[i][0];
+			x_single += ((double) fracGNf[i][0]);
+			deviation = MAX(deviation, fabs(x_single - x_double));
+		}
+	}
+
+	gsl_rng_free(r);
+	r = sampling_rng;
+	fftw_destroy_plan(p2);
+	fftwf_destroy_plan(p2f);
+	fftw_free(rndW);
+	fftw_free(fracGN);
+	fftwf_free(rndWf);
+	fftwf_free(fracGNf);
+	free(randomComplexGaussian);
+	free(amplitudes);
+	END_CATCH_ERRORS
+	return deviation;
+#else
+	END_CATCH_ERRORS
+	return -1.0;
+#endif
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+	double x = *((const double*) a), y = *((const double*) b);
+	return ( (x > y) - (x < y));
+}
+
+int fbm_sampler_single_precision_check(fbm_sampler* s, int samples, int* differing, double* ks_distance, double* mean_difference, double* passage_single, double* passage_double)
+{
+#ifdef FBM_SINGLE_SUBGRID
+	if( !s->params.single_precision || (samples < 1)){set_error_message("The single precision check needs a single precision sampler and at least one sample."); return -1;}
+	int k, i, j, precision, last_point_index;
+	double *fpts, *fpt_double, *fpt_single;
+	fftw_complex *rndW, *fracGN;
+	complex_z *randomComplexGaussian;
+	fftw_plan p2;
+	fbm_parameters* p = &(s->params);
+	long unresolved_midpoints = s->QI->unresolved_midpoints; // The check does not count towards the samples
+	jmp_buf handler;
+	jmp_buf* caller_handler = error_handler;
+	if(setjmp(handler) != 0)
+	{
+		// Leave the sampler as it was
+		error_handler = caller_handler;
+		s->QI->unresolved_midpoints = unresolved_midpoints;
+		activate_sampler(s);
+		return -1;
+	}
+	error_handler = &handler;
+	ALLOC(fpt_double, samples);
+	ALLOC(fpt_single, samples);
+	// The double precision subgrid needs buffers of its own, the sampler only holds the single precision ones
+	FFT_ALLOC(rndW, 2*(s->N));
+	FFT_ALLOC(fracGN, 2*(s->N));
+	ALLOC(randomComplexGaussian, s->N);
+	p2 = fftw_plan_dft_1d(2*(s->N), rndW, fracGN, FFTW_BACKWARD, FFTW_ESTIMATE);
+
+	// As fbm_sampler_sample_weighted, with test sample k drawn from its own streams in both precisions
+	activate_sampler(s);
+	r = gsl_rng_alloc(stream_rng_type);
+	for(precision = 0; precision < 2; precision++)
+	{
+		fpts = (precision ? fpt_single : fpt_double);
+		for(k = 0; k < samples; k++)
+		{
+			set_sample_stream(r, p->seed, 2*((unsigned long) k), STREAM_DOMAIN_FPT_TESTS);
+			if(precision)
+			{
+				draw_subgrid_noise(s, NULL, NULL, NULL, s->rndWf, s->fracGNf);
+				integrate_noise(s->fracbm, NULL, s->fracGNf, p->tilt, p->lin_drift, p->frac_drift, s->N, p->hurst, &last_point_index, p->passage_height);
+			}
+			else
+			{
+				generate_random_vector(randomComplexGaussian, rndW, s->circulant_eigenvalues, s->N, 1.0);
+				fftw_execute(p2);
+				integrate_noise(s->fracbm, fracGN, NULL, p->tilt, p->lin_drift, p->frac_drift, s->N, p->hurst, &last_point_index, p->passage_height);
+			}
+			copy_QI(s->QCholeskyFactor, last_point_index, (1/((double) s->N)));
+			set_sample_stream(r, p->seed, (2*((unsigned long) k) + 1), STREAM_DOMAIN_FPT_TESTS);
+			fpts[k] = 0.0;
+			find_fpt(s->fracbm, &(fpts[k]), p->passage_height, s->N, p->epsilon, p->hurst, last_point_index);
+		}
+	}
+	gsl_rng_free(r);
+	r = s->r;
+	s->QI->unresolved_midpoints = unresolved_midpoints;
+	fftw_destroy_plan(p2);
+	fftw_free(rndW);
+	fftw_free(fracGN);
+	free(randomComplexGaussian);
+
+	// The FPT is interpolated within the finest bisection interval. Rounding moves it slightly inside the interval; a sample only changes if it crosses in another interval.
+	double resolution = pow(2.0, (s->subgrid_levels + s->bisection_levels));
+	*differing = 0;
+	*mean_difference = 0.0;
+	*passage_single = 0.0;
+	*passage_double = 0.0;
+	for(k = 0; k < samples; k++)
+	{
+		*mean_difference += ( (fpt_single[k] - fpt_double[k]) / samples);
+		fpt_single[k] = floor(fpt_single[k] * resolution); // Index of the crossing interval
+		fpt_double[k] = floor(fpt_double[k] * resolution);
+		if(fpt_single[k] != fpt_double[k]){(*differing)++;}
+		if(fpt_single[k] < resolution){*passage_single += (1.0/samples);} // FPT 1.0 is the censored value
+		if(fpt_double[k] < resolution){*passage_double += (1.0/samples);}
+	}
+
+	// Kolmogorov-Smirnov distance: largest difference of the two empirical distribution functions of the crossing intervals
+	qsort(fpt_single, samples, sizeof(double), compare_doubles);
+	qsort(fpt_double, samples, sizeof(double), compare_doubles);
+	*ks_distance = 0.0;
+	i = 0;
+	j = 0;
+	while( (i < samples) && (j < samples))
+	{
+		double t = MIN(fpt_single[i], fpt_double[j]);
+		while( (i < samples) && (fpt_single[i] <= t)){i++;}
+		while( (j < samples) && (fpt_double[j] <= t)){j++;}
+		*ks_distance = MAX(*ks_distance, (fabs((double) (i - j)) / samples));
+	}
+
+	free(fpt_double);
+	free(fpt_single);
+	END_CATCH_ERRORS
+	return 0;
+#else
+	set_error_message("Single precision subgrid needs a build with single precision FFTW (SINGLE=1).");
+	return -1;
+#endif
+}
+
+int fbm_sampler_sample(fbm_sampler* s, long n, double* first_passage_times)
+{
+	return fbm_sampler_sample_weighted(s, n, first_passage_times, NULL);
+}
+
+int fbm_sampler_sample_weighted(fbm_sampler* s, long n, double* first_passage_times, double* weights)
+{
+	CATCH_ERRORS(-1)
+	long k;
+	int last_point_index; // Index of the first point to cross the barrier (=N, if this doesn't happen)
+	fbm_parameters* p = &(s->params);
+
+	activate_sampler(s);
+	for(k = 0; k < n; k++)
+	{
+		draw_subgrid_noise(s, s->randomComplexGaussian, s->rndW, s->fracGN, s->rndWf, s->fracGNf);
+
+		// Likelihood ratio of the subgrid drawn with tilt
+		if(weights != NULL){weights[k] = ( (p->tilt != 0.0) ? likelihood_ratio(s->fracGN, s->fracGNf, s->tilt_direction, s->tilt_norm, p->tilt, s->N) : 1.0);}
+
+		// Reset first passage times
+		first_passage_times[k] = 0.0;
+		// Integrate fractional Gaussain noise to fBM. The tilt enters the subgrid only, the midpoints are conditioned on the tilted subgrid as without tilt.
+		integrate_noise(s->fracbm, s->fracGN, s->fracGNf, p->tilt, p->lin_drift, p->frac_drift, s->N, p->hurst, &last_point_index, p->passage_height);
+
+		// Find the first passage by adaptive bisections, conditioned on the subgrid up to last_point_index
+		copy_QI(s->QCholeskyFactor, last_point_index, (1/((double) s->N)));
+		find_fpt(s->fracbm, &(first_passage_times[k]), p->passage_height, s->N, p->epsilon, p->hurst, last_point_index);
+	}
+	END_CATCH_ERRORS
+	return 0;
+}
+
+int fbm_sampler_sample_drifts(fbm_sampler* s, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* first_passage_times, double* weights)
+{
+	/* Every drift is searched on the same drift-free path. QI is set up once per sample, on the subgrid up to the last crossing of all drifts, and is then shared: midpoints drawn for one drift are conditioning points, and if requested again reused values, for the next.
+	 * The refinement tree thus is the union of the trees each drift needs, and the FPTs of different drifts are coupled (common random numbers). */
+	CATCH_ERRORS(-1)
+	long k;
+	int d, max_last_point_index;
+	fbm_parameters* p = &(s->params);
+
+	// Workspace is only allocated when a call needs more than any before
+	if(s->QI->midpoint_catalogue == NULL){enable_midpoint_catalogue(s->QI, (s->subgrid_levels + s->bisection_levels));}
+	if(number_of_drifts > s->drift_workspace_length)
+	{
+		s->drift_workspace_length = 0; // Until the allocation has succeeded
+		REALLOC(s->drift_last_point_index, number_of_drifts);
+		s->drift_workspace_length = number_of_drifts;
+	}
+
+	activate_sampler(s);
+	for(k = 0; k < n; k++)
+	{
+		draw_subgrid_noise(s, s->randomComplexGaussian, s->rndW, s->fracGN, s->rndWf, s->fracGNf);
+
+		// Likelihood ratio of the subgrid drawn with tilt, the same for every drift
+		if(weights != NULL){weights[k] = ( (p->tilt != 0.0) ? likelihood_ratio(s->fracGN, s->fracGNf, s->tilt_direction, s->tilt_norm, p->tilt, s->N) : 1.0);}
+
+		integrate_noise_drifts(s->fracGN, s->fracGNf, p->tilt, number_of_drifts, lin_drifts, frac_drifts, s->N, p->hurst, s->drift_last_point_index, &max_last_point_index, p->passage_height);
+		copy_QI(s->QCholeskyFactor, max_last_point_index, (1/((double) s->N)));
+
+		for(d = 0; d < number_of_drifts; d++)
+		{
+			lin_drift = lin_drifts[d];
+			frac_drift = frac_drifts[d];
+			add_drift(s->fracbm, lin_drift, frac_drift, s->N, p->hurst, s->drift_last_point_index[d]);
+			first_passage_times[k*number_of_drifts + d] = 0.0;
+			find_fpt(s->fracbm, &(first_passage_times[k*number_of_drifts + d]), p->passage_height, s->N, p->epsilon, p->hurst, s->drift_last_point_index[d]);
+		}
+	}
+	lin_drift = p->lin_drift;
+	frac_drift = p->frac_drift;
+	END_CATCH_ERRORS
+	return 0;
+}
+
+const fbm_parameters* fbm_sampler_parameters(const fbm_sampler* s)
+{
+	return &(s->params);
+}
+
+long fbm_sampler_unresolved_midpoints(const fbm_sampler* s)
+{
+	return s->QI->unresolved_midpoints;
+}
+
+void fbm_sampler_destroy(fbm_sampler* s)
+{
+	int i;
+	if(s == NULL) return;
+	fbm_sampler_stop_parallel(s);
+	// Do not leave the globals pointing at freed memory
+	if(QI == s->QI){QI = NULL; r = NULL; gamma_N_vec = NULL; g_vec = NULL; xfracbm = NULL;}
+	if(s->p1 != NULL){fftw_destroy_plan(s->p1);}
+	if(s->p2 != NULL){fftw_destroy_plan(s->p2);}
+#ifdef FBM_SINGLE_SUBGRID
+	if(s->p2f != NULL){fftwf_destroy_plan(s->p2f);}
+	fftwf_free(s->rndWf);
+	fftwf_free(s->fracGNf);
+#endif
+	free(s->noise_amplitudes);
+	fftw_free(s->correlation);
+	fftw_free(s->circulant_eigenvalues);
+	fftw_free(s->rndW);
+	fftw_free(s->fracGN);
+	free(s->correlation_exponents);
+	free(s->randomComplexGaussian);
+	free(s->fracbm);
+	free(s->xfracbm);
+	free(s->QCholeskyFactor);
+	free(s->tilt_direction);
+	free(s->drift_last_point_index);
+	free(s->gamma_N_vec);
+	free(s->g_vec);
+	free_QI(&(s->QI));
+	for(i = 0; i < s->number_of_workers; i++){free_worker(&(s->workers[i]));}
+	free(s->workers);
+	if(s->r != NULL){gsl_rng_free(s->r);}
+	free(s);
+}
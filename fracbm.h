@@ -0,0 +1,86 @@
+/* fracbm-fpt-mc (2019)
+ * Authors: Benjamin Walter, Kay Wiese
+ * Library interface (libfracbm) */
+
+#ifndef FRACBM_H
+#define FRACBM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fbm_parameters
+{
+	/* Everything that determines the ensemble. Start from fbm_default_parameters() and overwrite what is needed. */
+	double hurst;		// Hurst parameter 0 < H < 1
+	int g;			// 2^g is the number of subgrid points
+	int max_generation;	// Maximal number of additional bisections G. Effective system size 2^(g+G).
+	double epsilon;		// Tolerance probability with which a midpoint might be falsenegative
+	double lin_drift;	// Z_t = X_t + lin_drift * t + frac_drift * t^(2H). Note that the command line flags -m and -n of 'fbm' take the negative of these.
+	double frac_drift;
+	double passage_height;	// Barrier m > 0
+	int seed;		// RNG seed, -1 takes it from the clock
+	int coarse_levels;	// Coarse-to-fine: the Davies-Harte subgrid has only 2^(g - coarse_levels) points, the remaining levels down to 2^g are refined by bisection only where the path can reach the barrier. 0 draws the full subgrid. Same as g - coarse_levels and max_generation + coarse_levels.
+	double tilt;		// Importance sampling: the subgrid is drawn with the additional drift tilt * t and every sample carries the likelihood ratio as weight. 0 switches it off.
+	int single_precision;	// 1 draws the Davies-Harte subgrid in single precision (Gaussian numbers scaled and transformed in float, fftwf), the path is summed up and refined in double. Only if the library is built with SINGLE=1.
+} fbm_parameters;
+
+typedef struct fbm_sampler fbm_sampler;
+
+/* Fills in the defaults of the command line tool. */
+void fbm_default_parameters(fbm_parameters*);
+
+/* Errors: the library neither prints nor terminates the program. fbm_sampler_create returns NULL, the sampling functions return -1 (0 on success) if the parameters are out of range, memory runs out or LAPACK fails, and fbm_error_message() then describes the error.
+ * The message is per thread. Memory held by the failed call may not be returned, the sampler itself can still be used or destroyed. */
+const char* fbm_error_message(void);
+
+/* Sets up a sampler: all buffers, the FFT plans and the Cholesky factor of the subgrid are prepared once. Returns NULL on error. */
+fbm_sampler* fbm_sampler_create(const fbm_parameters*);
+
+/* Draws n first passage times into the caller's buffer. Paths without passage on [0,1] give 1.0. The sampler's buffers are reused; only the nodes of the bisection tree are allocated, and freed, per sample. */
+int fbm_sampler_sample(fbm_sampler*, long n, double* first_passage_times);
+
+/* As fbm_sampler_sample, and writes the likelihood ratio of each sample into weights (1.0 unless the tilt is switched on). Averages over the ensemble have to be weighted with these. */
+int fbm_sampler_sample_weighted(fbm_sampler*, long n, double* first_passage_times, double* weights);
+
+/* Evaluates several drifts (lin_drifts[d], frac_drifts[d]), d = 0, ..., number_of_drifts - 1, on each path. The drift in the parameters is not used. All drifts see the same drift-free path and one shared refinement, so differences between drifts have little noise (common random numbers).
+ * first_passage_times[k*number_of_drifts + d] is the FPT of sample k for drift d. weights may be NULL, otherwise it gets one likelihood ratio per sample. Only the first call, or a call with more drifts than before, allocates workspace. */
+int fbm_sampler_sample_drifts(fbm_sampler*, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* first_passage_times, double* weights);
+
+/* Draws the samples with indices first_index, ..., first_index + n - 1 (< 2^31) on several threads: 'producers' threads generate subgrids into a bounded queue, from which 'consumers' threads take them for the bisection.
+ * Each sample has its own random number streams: the counter-based generator Philox4x32-10 keyed by the seed and the sample index. No two samples, of the same or of different seeds, share random numbers. The result thus depends neither on the thread counts nor on the order in which the samples finish, and ranges drawn in separate calls fit together. It differs from fbm_sampler_sample with the same seed, which draws all samples from one stream.
+ * With producers = consumers = 0, the same samples are drawn on the calling thread.
+ * Drifts, first_passage_times and weights as in fbm_sampler_sample_drifts, indexed relative to first_index. Thread buffers are allocated by the first call and kept. */
+int fbm_sampler_sample_parallel(fbm_sampler*, int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* first_passage_times, double* weights);
+
+/* The same in steps, for output while the threads keep running: fbm_sampler_start_parallel starts the threads on the samples first_index, ..., first_index + n - 1, fbm_sampler_collect_parallel waits for the next m of them in order and copies them out, fbm_sampler_stop_parallel stops the threads, also before all samples are collected.
+ * The threads run up to PIPELINE_WINDOW (32768) samples ahead of the collected ones. The drift arrays have to stay valid until the pipeline is stopped; one pipeline per sampler at a time, and the other sampling functions of the sampler must not be called while it runs. fbm_sampler_destroy stops a running pipeline. */
+int fbm_sampler_start_parallel(fbm_sampler*, int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts);
+int fbm_sampler_collect_parallel(fbm_sampler*, long m, double* first_passage_times, double* weights);
+void fbm_sampler_stop_parallel(fbm_sampler*);
+
+/* Draws 'paths' subgrids from the same Gaussian numbers in single and in double precision, and returns the largest deviation of the integrated paths. critical_strip gets the width of the critical strip on the subgrid, for comparison. Uses its own random numbers, the samples are not affected.
+ * Returns -1 if the library is built without single precision support, or on error. */
+double fbm_sampler_single_precision_deviation(fbm_sampler*, int paths, double* critical_strip);
+
+/* Distributional check of the single precision subgrid: finds the FPT of 'samples' test samples twice, with the subgrid in single and in double precision, on the same random numbers and with the drift of the parameters. Uses its own random numbers, the samples are not affected.
+ * The FPT is interpolated within the finest bisection interval, of length 2^-(g + max_generation), so it is compared by this interval. differing gets the number of samples that cross in another interval, ks_distance the Kolmogorov-Smirnov distance of the two empirical distributions of the crossing interval (at most differing / samples, since the samples are paired), mean_difference the mean of FPT(single) - FPT(double), passage_single and passage_double the fractions with FPT < 1.
+ * If no sample differs, the probability that single precision changes a sample is below 3 / samples with 95% confidence.
+ * Returns -1 if the sampler does not use a single precision subgrid, or on error, 0 otherwise. */
+int fbm_sampler_single_precision_check(fbm_sampler*, int samples, int* differing, double* ks_distance, double* mean_difference, double* passage_single, double* passage_double);
+
+/* Parameters of the sampler, with the seed actually used. */
+const fbm_parameters* fbm_sampler_parameters(const fbm_sampler*);
+
+/* Number of midpoints so far whose conditional variance was below double precision resolution (see fbm_header.h). */
+long fbm_sampler_unresolved_midpoints(const fbm_sampler*);
+
+void fbm_sampler_destroy(fbm_sampler*);
+
+/* The working variables of the samplers are thread local: different samplers may sample on different threads at the same time, one sampler on one thread at a time. Create and destroy samplers from a single thread, FFTW planning is not thread safe. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+/* fracbm-fpt-mc (2019)
+ * Authors: Benjamin Walter, Kay Wiese
+ * C++ interface (libfracbm) */
+
+#ifndef FRACBM_HPP
+#define FRACBM_HPP
+
+#include <stdexcept>
+#include <string>
+#include "fracbm.h"
+
+namespace fracbm
+{
+
+// Owns one fbm_sampler. Configured once, then sample() fills caller-provided buffers.
+class Sampler
+{
+public:
+	static fbm_parameters defaults()
+	{
+		fbm_parameters params;
+		fbm_default_parameters(&params);
+		return params;
+	}
+
+	explicit Sampler(const fbm_parameters& params) : sampler_(fbm_sampler_create(&params))
+	{
+		if(sampler_ == nullptr){throw std::invalid_argument(std::string("fracbm::Sampler: ") + fbm_error_message());}
+	}
+
+	~Sampler(){fbm_sampler_destroy(sampler_);}
+
+	Sampler(const Sampler&) = delete;
+	Sampler& operator=(const Sampler&) = delete;
+
+	Sampler(Sampler&& other) noexcept : sampler_(other.sampler_){other.sampler_ = nullptr;}
+	Sampler& operator=(Sampler&& other) noexcept
+	{
+		if(this != &other)
+		{
+			fbm_sampler_destroy(sampler_);
+			sampler_ = other.sampler_;
+			other.sampler_ = nullptr;
+		}
+		return *this;
+	}
+
+	// Draws n first passage times into out[0], ..., out[n-1]. Paths without passage on [0,1] give 1.0.
+	void sample(long n, double* out){check(fbm_sampler_sample(sampler_, n, out));}
+
+	// As sample(), and writes the likelihood ratio of each sample into weights[0], ..., weights[n-1].
+	void sample(long n, double* out, double* weights){check(fbm_sampler_sample_weighted(sampler_, n, out, weights));}
+
+	// Several drifts on each path, out[k*number_of_drifts + d] is sample k for drift d. weights may be nullptr.
+	void sample_drifts(long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* out, double* weights = nullptr)
+	{
+		check(fbm_sampler_sample_drifts(sampler_, n, number_of_drifts, lin_drifts, frac_drifts, out, weights));
+	}
+
+	// Samples first_index, ..., first_index + n - 1 on producers + consumers threads, see fbm_sampler_sample_parallel.
+	void sample_parallel(int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts, double* out, double* weights = nullptr)
+	{
+		check(fbm_sampler_sample_parallel(sampler_, producers, consumers, first_index, n, number_of_drifts, lin_drifts, frac_drifts, out, weights));
+	}
+
+	// The same in steps, see fbm_sampler_start_parallel. The destructor stops a running pipeline.
+	void start_parallel(int producers, int consumers, long first_index, long n, int number_of_drifts, const double* lin_drifts, const double* frac_drifts)
+	{
+		check(fbm_sampler_start_parallel(sampler_, producers, consumers, first_index, n, number_of_drifts, lin_drifts, frac_drifts));
+	}
+
+	void collect_parallel(long m, double* out, double* weights = nullptr)
+	{
+		check(fbm_sampler_collect_parallel(sampler_, m, out, weights));
+	}
+
+	void stop_parallel(){fbm_sampler_stop_parallel(sampler_);}
+
+	// Largest deviation of single from double precision subgrids, see fbm_sampler_single_precision_deviation.
+	double single_precision_deviation(int paths, double* critical_strip){return fbm_sampler_single_precision_deviation(sampler_, paths, critical_strip);}
+
+	// FPTs of test samples in both precisions, see fbm_sampler_single_precision_check.
+	int single_precision_check(int samples, int* differing, double* ks_distance, double* mean_difference, double* passage_single, double* passage_double){return fbm_sampler_single_precision_check(sampler_, samples, differing, ks_distance, mean_difference, passage_single, passage_double);}
+
+	const fbm_parameters& parameters() const {return *fbm_sampler_parameters(sampler_);}
+	long unresolved_midpoints() const {return fbm_sampler_unresolved_midpoints(sampler_);}
+
+	fbm_sampler* handle(){return sampler_;}
+
+private:
+	// Errors of the C interface become exceptions
+	static void check(int status){if(status != 0){throw std::runtime_error(std::string("fracbm::Sampler: ") + fbm_error_message());}}
+
+	fbm_sampler* sampler_;
+};
+
+} // namespace fracbm
+
+#endif